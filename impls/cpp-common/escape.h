@@ -0,0 +1,231 @@
+#ifndef MAL_CPP_COMMON_ESCAPE_H
+#define MAL_CPP_COMMON_ESCAPE_H
+
+// Escaping and unescaping of string literals, shared by the cpp and cpp2
+// readers and printers. Written to C++11, for cpp.
+//
+// Most text needs no escaping, so both directions look for the next
+// character that does with a vector kernel, which tests 32 (AVX2) or 16
+// (SSE2) bytes at a time, and append the clean run before it in one go.
+// The kernel is picked once, from what the CPU supports; anything other
+// than x86 uses the plain loop the kernels finish with.
+
+#include <cstddef>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAL_ESCAPE_X86
+#include <immintrin.h>
+#endif
+
+namespace mal_escape {
+
+enum Flags {
+    // \t, \r and \b are escapes too, besides \\, \" and \n.
+    CONTROL_CHARS = 1,
+    // Unescaping leaves a backslash before any other character, rather
+    // than dropping it.
+    KEEP_UNKNOWN = 2,
+};
+
+namespace detail {
+
+// The characters a kernel looks for: the first count of chars, which the
+// scalar loop finds through table instead.
+struct CharSet {
+    const char* chars;
+    int count;
+    const bool* table;
+};
+
+struct CharTable {
+    CharTable(const char* chars, int count) : hits() {
+        for (int c = 0; c < count; c++) {
+            hits[(unsigned char)chars[c]] = true;
+        }
+    }
+    bool hits[256];
+};
+
+// The table for the first Count of chars, which are the same on each call.
+template<int Count>
+const bool* charTable(const char* chars) {
+    static CharTable table(chars, Count);
+    return table.hits;
+}
+
+inline CharSet escapedChars(unsigned flags) {
+    const char* chars = "\\\"\n\t\r\b";
+    if (flags & CONTROL_CHARS) {
+        CharSet set = { chars, 6, charTable<6>(chars) };
+        return set;
+    }
+    CharSet set = { chars, 3, charTable<3>(chars) };
+    return set;
+}
+
+inline CharSet backslash() {
+    CharSet set = { "\\", 1, charTable<1>("\\") };
+    return set;
+}
+
+// Each kernel returns the offset of the first of set in [s, s + n), or n.
+typedef size_t (*Kernel)(const char* s, size_t n, CharSet set);
+
+inline size_t findScalar(const char* s, size_t n, CharSet set) {
+    for (size_t i = 0; i < n; i++) {
+        if (set.table[(unsigned char)s[i]]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+#ifdef MAL_ESCAPE_X86
+
+__attribute__((target("sse2")))
+inline size_t findSSE2(const char* s, size_t n, CharSet set) {
+    __m128i wanted[6];
+    for (int c = 0; c < set.count; c++) {
+        wanted[c] = _mm_set1_epi8(set.chars[c]);
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i hits = _mm_cmpeq_epi8(block, wanted[0]);
+        for (int c = 1; c < set.count; c++) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, wanted[c]));
+        }
+        if (unsigned mask = _mm_movemask_epi8(hits)) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findScalar(s + i, n - i, set);
+}
+
+__attribute__((target("avx2")))
+inline size_t findAVX2(const char* s, size_t n, CharSet set) {
+    __m256i wanted[6];
+    for (int c = 0; c < set.count; c++) {
+        wanted[c] = _mm256_set1_epi8(set.chars[c]);
+    }
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i hits = _mm256_cmpeq_epi8(block, wanted[0]);
+        for (int c = 1; c < set.count; c++) {
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, wanted[c]));
+        }
+        if (unsigned mask = _mm256_movemask_epi8(hits)) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findSSE2(s + i, n - i, set);
+}
+
+#endif // MAL_ESCAPE_X86
+
+inline Kernel bestKernel() {
+#ifdef MAL_ESCAPE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return findAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return findSSE2;
+    }
+#endif
+    return findScalar;
+}
+
+// The kernel in use, which the benchmark can swap.
+inline Kernel& kernel() {
+    static Kernel k = bestKernel();
+    return k;
+}
+
+inline char escapeFor(char c) {
+    switch (c) {
+        case '\n': return 'n';
+        case '\t': return 't';
+        case '\r': return 'r';
+        case '\b': return 'b';
+        default:   return c;
+    }
+}
+
+// The character "\c" stands for, or 0 if c isn't an escape.
+inline char unescapeFor(char c, unsigned flags) {
+    switch (c) {
+        case '\\': return '\\';
+        case '"':  return '"';
+        case 'n':  return '\n';
+    }
+    if (flags & CONTROL_CHARS) {
+        switch (c) {
+            case 't': return '\t';
+            case 'r': return '\r';
+            case 'b': return '\b';
+        }
+    }
+    return 0;
+}
+
+} // namespace detail
+
+// Appends the n characters at s to out, escaped (without quotes).
+inline void escape(std::string& out, const char* s, size_t n,
+                   unsigned flags = 0) {
+    detail::CharSet set = detail::escapedChars(flags);
+    detail::Kernel find = detail::kernel();
+    out.reserve(out.size() + n);
+    for (size_t i = 0; i < n; ) {
+        size_t next = i + find(s + i, n - i, set);
+        out.append(s + i, next - i);
+        if (next == n) {
+            break;
+        }
+        out += '\\';
+        out += detail::escapeFor(s[next]);
+        i = next + 1;
+    }
+}
+
+// Appends the n characters at s to out, unescaped (without quotes). A
+// backslash at the very end is dropped, unless KEEP_UNKNOWN is set.
+inline void unescape(std::string& out, const char* s, size_t n,
+                     unsigned flags = 0) {
+    detail::CharSet set = detail::backslash();
+    detail::Kernel find = detail::kernel();
+    out.reserve(out.size() + n);
+    for (size_t i = 0; i < n; ) {
+        size_t next = i + find(s + i, n - i, set);
+        out.append(s + i, next - i);
+        if (next == n) {
+            break;
+        }
+        if (next + 1 == n) {
+            if (flags & KEEP_UNKNOWN) {
+                out += '\\';
+            }
+            break;
+        }
+        char c = s[next + 1];
+        if (char u = detail::unescapeFor(c, flags)) {
+            out += u;
+            i = next + 2;
+        }
+        else if (flags & KEEP_UNKNOWN) {
+            out += '\\';
+            i = next + 1;
+        }
+        else {
+            out += c;
+            i = next + 2;
+        }
+    }
+}
+
+} // namespace mal_escape
+
+#endif // MAL_CPP_COMMON_ESCAPE_H
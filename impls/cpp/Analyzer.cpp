@@ -0,0 +1,740 @@
+#include "Analyzer.h"
+#include "Environment.h"
+#include "Types.h"
+#include "Validation.h"
+
+#include <algorithm>
+#include <iostream>
+
+typedef std::vector<malCodePtr> malCodeVec;
+
+namespace {
+
+malCodePtr analyze(malValuePtr ast, const malEnvPtr& env, malScope* scope);
+
+void visitCode(RefCounted::Visitor& visitor, const malCodeVec& code)
+{
+    for (auto it = code.begin(), end = code.end(); it != end; ++it) {
+        visitRef(visitor, *it);
+    }
+}
+
+// Code which only ever produces a value.
+class Leaf : public malCode {
+public:
+    Leaf(malValuePtr source, Kind kind = TREE) : malCode(source, kind) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        return value(env);
+    }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        if (env->debugEval()) {
+            std::cout << "EVAL: " << source()->print(true) << "\n";
+        }
+        return value(env);
+    }
+
+    virtual malValuePtr value(const malEnvPtr& env) const = 0;
+};
+
+class Constant : public Leaf {
+public:
+    Constant(malValuePtr source, malValuePtr value)
+    : Leaf(source, CONSTANT), m_value(value) { }
+
+    virtual malValuePtr value(const malEnvPtr& env) const {
+        return m_value;
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitRef(visitor, m_value);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_value = NULL;
+    }
+
+private:
+    malValuePtr m_value;
+};
+
+// Rethrows an error from analyzing a form when the form is run, which is
+// when evaluating it would have thrown.
+class Throw : public malCode {
+public:
+    Throw(malValuePtr source, const String& error)
+    : malCode(source), m_error(error) { }
+    Throw(malValuePtr source, malValuePtr value)
+    : malCode(source), m_value(value) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        if (m_value) {
+            throw m_value;
+        }
+        throw m_error;
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitRef(visitor, m_value);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_value = NULL;
+    }
+
+private:
+    const String m_error;
+    malValuePtr m_value;
+};
+
+// A symbol the analyzer couldn't place, usually a global.
+class Lookup : public Leaf {
+public:
+    Lookup(malValuePtr source)
+    : Leaf(source)
+    , m_id(STATIC_CAST(malSymbol, source)->name().id()) { }
+
+    virtual malValuePtr value(const malEnvPtr& env) const {
+        return env->get(m_id, m_cache);
+    }
+
+protected:
+    const malEnv::Id m_id;
+
+private:
+    mutable malEnv::GlobalCache m_cache;
+};
+
+// A symbol bound by a frame the analyzer planned. The slot's name is
+// checked in case something changed the frame anyway.
+class Local : public Lookup {
+public:
+    Local(malValuePtr source, int depth, int slot)
+    : Lookup(source), m_depth(depth), m_slot(slot) { }
+
+    virtual malValuePtr value(const malEnvPtr& env) const {
+        if (malValuePtr* value = env->slot(m_depth, m_slot, m_id)) {
+            return *value;
+        }
+        return Lookup::value(env);
+    }
+
+private:
+    const int m_depth;
+    const int m_slot;
+};
+
+class Def : public malCode {
+public:
+    Def(malValuePtr source, const malSymbol* name, malCodePtr value,
+        bool isMacro)
+    : malCode(source), m_name(name->name()), m_value(value)
+    , m_isMacro(isMacro) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        malValuePtr value = m_value->eval(env);
+        if (m_isMacro) {
+            value = mal::macro(*VALUE_CAST(malLambda, value));
+        }
+        return env->set(m_name, value);
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitRef(visitor, m_value);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_value = NULL;
+    }
+
+private:
+    const malEnv::Name m_name;
+    malCodePtr m_value;
+    const bool m_isMacro;
+};
+
+class Do : public malCode {
+public:
+    Do(malValuePtr source, const malCodeVec& body)
+    : malCode(source), m_body(body) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        int last = m_body.size() - 1;
+        for (int i = 0; i < last; i++) {
+            m_body[i]->eval(env);
+        }
+        next = m_body[last];
+        return NULL;
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitCode(visitor, m_body);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_body.clear();
+    }
+
+private:
+    malCodeVec m_body;
+};
+
+class Fn : public malCode {
+public:
+    Fn(malValuePtr source, const malEnv::Params& params, malValuePtr body,
+       malCodePtr code)
+    : malCode(source), m_params(params), m_body(body), m_code(code) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        return mal::lambda(m_params, m_body, env, m_code);
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitRef(visitor, m_body);
+        visitRef(visitor, m_code);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_body = NULL;
+        m_code = NULL;
+    }
+
+private:
+    const malEnv::Params m_params;
+    malValuePtr m_body;
+    malCodePtr m_code;
+};
+
+class If : public malCode {
+public:
+    If(malValuePtr source, malCodePtr test, malCodePtr then,
+       malCodePtr otherwise)
+    : malCode(source), m_test(test), m_then(then), m_else(otherwise) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        bool isTrue = m_test->eval(env).isTrue();
+        if (!isTrue && !m_else) {
+            return mal::nilValue();
+        }
+        next = isTrue ? m_then : m_else;
+        return NULL;
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitRef(visitor, m_test);
+        visitRef(visitor, m_then);
+        visitRef(visitor, m_else);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_test = m_then = m_else = NULL;
+    }
+
+private:
+    malCodePtr m_test;
+    malCodePtr m_then;
+    malCodePtr m_else;
+};
+
+class Let : public malCode {
+public:
+    Let(malValuePtr source, const std::vector<malEnv::Name>& names,
+        const malCodeVec& values, int slots, malCodePtr body)
+    : malCode(source), m_names(names), m_values(values), m_slots(slots)
+    , m_body(body) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        malEnvPtr inner(new malEnv(env, m_slots));
+        for (int i = 0, n = m_names.size(); i < n; i++) {
+            inner->set(m_names[i], m_values[i]->eval(inner));
+        }
+        env = inner;
+        next = m_body;
+        return NULL;
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitCode(visitor, m_values);
+        visitRef(visitor, m_body);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_values.clear();
+        m_body = NULL;
+    }
+
+private:
+    const std::vector<malEnv::Name> m_names;
+    malCodeVec m_values;
+    const int m_slots;
+    malCodePtr m_body;
+};
+
+class Try : public malCode {
+public:
+    Try(malValuePtr source, malCodePtr body, const malSymbol* name,
+        malCodePtr handler)
+    : malCode(source), m_body(body), m_name(name->name())
+    , m_handler(handler) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        malValuePtr excVal;
+
+        try {
+            return m_body->eval(env);
+        }
+        catch(String& s) {
+            excVal = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            // Not an error, continue as if we got nil
+            return mal::nilValue();
+        }
+        catch(malValuePtr& o) {
+            excVal = o;
+        };
+
+        env = malEnvPtr(new malEnv(env, 1));
+        env->set(m_name, excVal);
+        next = m_handler;
+        return NULL;
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitRef(visitor, m_body);
+        visitRef(visitor, m_handler);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_body = m_handler = NULL;
+    }
+
+private:
+    malCodePtr m_body;
+    const malEnv::Name m_name;
+    malCodePtr m_handler;
+};
+
+class Call : public malCode {
+public:
+    Call(malValuePtr source, malCodePtr op, const malCodeVec& args)
+    : malCode(source), m_op(op), m_args(args) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        malValuePtr op = m_op->eval(env);
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+        if (lambda && lambda->isMacro()) {
+            // It wasn't a macro when this was analyzed.
+            const malList* list = STATIC_CAST(malList, source());
+            malValuePtr ast = lambda->apply(list->begin() + 1, list->end());
+            next = analyze(ast, env, NULL);
+            return NULL;
+        }
+
+        malArgs args(m_args.size());
+        for (int i = 0, n = m_args.size(); i < n; i++) {
+            args[i] = m_args[i]->eval(env);
+        }
+
+        if (lambda) {
+            malEnvPtr inner = lambda->makeEnv(args.begin(), args.end());
+            if (malCodePtr code = lambda->getCode()) {
+                env = inner;
+                next = code;
+                return NULL;
+            }
+            return EVAL(lambda->getBody(), inner);
+        }
+        return APPLY(op, args.begin(), args.end());
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitRef(visitor, m_op);
+        visitCode(visitor, m_args);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_op = NULL;
+        m_args.clear();
+    }
+
+private:
+    malCodePtr m_op;
+    malCodeVec m_args;
+};
+
+class Vector : public malCode {
+public:
+    Vector(malValuePtr source, const malCodeVec& items)
+    : malCode(source), m_items(items) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        malValueVec* items = new malValueVec(m_items.size());
+        for (int i = 0, n = m_items.size(); i < n; i++) {
+            (*items)[i] = m_items[i]->eval(env);
+        }
+        return mal::vector(items);
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitCode(visitor, m_items);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_items.clear();
+    }
+
+private:
+    malCodeVec m_items;
+};
+
+class Hash : public malCode {
+public:
+    Hash(malValuePtr source, malValuePtr keys, const malCodeVec& values)
+    : malCode(source), m_keys(keys), m_values(values) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const {
+        const malSequence* keys = STATIC_CAST(malSequence, m_keys);
+        malHash::Map map;
+        for (int i = 0, n = m_values.size(); i < n; i++) {
+            map = map.insert(keys->item(i), m_values[i]->eval(env));
+        }
+        return mal::hash(map);
+    }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        malCode::visitRefs(visitor);
+        visitRef(visitor, m_keys);
+        visitCode(visitor, m_values);
+    }
+    virtual void clearRefs() {
+        malCode::clearRefs();
+        m_keys = NULL;
+        m_values.clear();
+    }
+
+private:
+    malValuePtr m_keys;
+    malCodeVec m_values;
+};
+
+bool isConstant(const malCodePtr& code)
+{
+    return code->kind() == malCode::CONSTANT;
+}
+
+malCodePtr analyzeSymbol(malValuePtr ast, malScope* scope)
+{
+    malEnv::Id id = STATIC_CAST(malSymbol, ast)->name().id();
+    int depth, slot;
+    if (malScope::resolve(scope, id, depth, slot)) {
+        return new Local(ast, depth, slot);
+    }
+    return new Lookup(ast);
+}
+
+malCodeVec analyzeItems(const malSequence* seq, int first,
+                        const malEnvPtr& env, malScope* scope)
+{
+    malCodeVec code;
+    code.reserve(seq->count() - first);
+    for (int i = first; i < seq->count(); i++) {
+        code.push_back(analyze(seq->item(i), env, scope));
+    }
+    return code;
+}
+
+malCodePtr analyzeFn(malValuePtr ast, const malList* list,
+                     const malEnvPtr& env, malScope* scope)
+{
+    checkArgsIs("fn*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    StringVec names;
+    for (int i = 0; i < bindings->count(); i++) {
+        const malSymbol* sym = VALUE_CAST(malSymbol, bindings->item(i));
+        names.push_back(sym->value());
+    }
+    malEnv::Params params(names);
+
+    // Analyze the body again as an open scope if it turns out to need one.
+    for (bool open = false; ; open = true) {
+        malScope inner(scope, open);
+        inner.setParams(params);
+
+        malCodePtr body = analyze(list->item(2), env, &inner);
+        if (!inner.open || open) {
+            return new Fn(ast, params, list->item(2), body);
+        }
+    }
+}
+
+malCodePtr analyzeLet(malValuePtr ast, const malList* list,
+                      const malEnvPtr& env, malScope* scope)
+{
+    checkArgsIs("let*", 2, list->count() - 1);
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+
+    std::vector<malEnv::Name> names;
+    for (int i = 0; i < count; i += 2) {
+        names.push_back(VALUE_CAST(malSymbol, bindings->item(i))->name());
+    }
+
+    for (bool open = false; ; open = true) {
+        malScope inner(scope, open);
+        for (auto it = names.begin(), end = names.end(); it != end; ++it) {
+            inner.pending.push_back(it->id());
+        }
+
+        malCodeVec values;
+        for (int i = 0; i < count / 2; i++) {
+            values.push_back(analyze(bindings->item(2 * i + 1), env, &inner));
+            inner.set(names[i].id());
+            inner.pending.erase(std::find(inner.pending.begin(),
+                                          inner.pending.end(),
+                                          names[i].id()));
+        }
+
+        malCodePtr body = analyze(list->item(2), env, &inner);
+        if (!inner.open || open) {
+            return new Let(ast, names, values, inner.ids.size(), body);
+        }
+    }
+}
+
+malCodePtr analyzeTry(malValuePtr ast, const malList* list,
+                      const malEnvPtr& env, malScope* scope)
+{
+    int argCount = list->count() - 1;
+    malCodePtr body = analyze(list->item(1), env, scope);
+    if (argCount == 1) {
+        return body;
+    }
+    checkArgsIs("try*", 2, argCount);
+    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+    MAL_CHECK(VALUE_CAST(malSymbol,
+        catchBlock->item(0))->value() == "catch*",
+        "catch block must begin with catch*");
+
+    const malSymbol* excSym = VALUE_CAST(malSymbol, catchBlock->item(1));
+
+    for (bool open = false; ; open = true) {
+        malScope inner(scope, open);
+        inner.ids.push_back(excSym->name().id());
+
+        malCodePtr handler = analyze(catchBlock->item(2), env, &inner);
+        if (!inner.open || open) {
+            return new Try(ast, body, excSym, handler);
+        }
+    }
+}
+
+malCodePtr analyzeSpecial(malValuePtr ast, const malList* list,
+                          malSymbol::SpecialForm special,
+                          const malEnvPtr& env, malScope* scope)
+{
+    int argCount = list->count() - 1;
+
+    switch (special) {
+    case malSymbol::DEF:
+    case malSymbol::DEFMACRO: {
+        bool isMacro = special == malSymbol::DEFMACRO;
+        checkArgsIs(isMacro ? "defmacro!" : "def!", 2, argCount);
+        const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+        if (scope && scope->find(id->name().id()) < 0) {
+            scope->open = true;
+        }
+        return new Def(ast, id, analyze(list->item(2), env, scope), isMacro);
+    }
+
+    case malSymbol::DO:
+        checkArgsAtLeast("do", 1, argCount);
+        return new Do(ast, analyzeItems(list, 1, env, scope));
+
+    case malSymbol::FN:
+        return analyzeFn(ast, list, env, scope);
+
+    case malSymbol::IF:
+        checkArgsBetween("if", 2, 3, argCount);
+        return new If(ast, analyze(list->item(1), env, scope),
+                      analyze(list->item(2), env, scope),
+                      argCount == 3 ? analyze(list->item(3), env, scope)
+                                    : malCodePtr());
+
+    case malSymbol::LET:
+        return analyzeLet(ast, list, env, scope);
+
+    case malSymbol::QUASIQUOTE:
+        checkArgsIs("quasiquote", 1, argCount);
+        return analyze(quasiquote(list->item(1)), env, scope);
+
+    case malSymbol::QUOTE:
+        checkArgsIs("quote", 1, argCount);
+        return new Constant(ast, list->item(1));
+
+    case malSymbol::TRY:
+        return analyzeTry(ast, list, env, scope);
+
+    case malSymbol::NONE:
+        break;
+    }
+    return NULL;
+}
+
+malCodePtr analyzeForm(malValuePtr ast, const malEnvPtr& env, malScope* scope)
+{
+    if (ast.isImmediate()) {
+        return new Constant(ast, ast);
+    }
+    if (value_is<malSymbol>(ast)) {
+        return analyzeSymbol(ast, scope);
+    }
+    if (const malVector* vector = DYNAMIC_CAST(malVector, ast)) {
+        malCodeVec items = analyzeItems(vector, 0, env, scope);
+        if (std::all_of(items.begin(), items.end(), isConstant)) {
+            return new Constant(ast, ast);
+        }
+        return new Vector(ast, items);
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        if (hash->isEvaluated()) {
+            return new Constant(ast, ast);
+        }
+        malValuePtr values = hash->values();
+        return new Hash(ast, hash->keys(),
+                        analyzeItems(STATIC_CAST(malSequence, values), 0,
+                                     env, scope));
+    }
+
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return new Constant(ast, ast);
+    }
+
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (symbol && symbol->specialForm() != malSymbol::NONE) {
+        return analyzeSpecial(ast, list, symbol->specialForm(), env, scope);
+    }
+    if (symbol) {
+        if (const malLambda* macro = findMacro(symbol, env, scope)) {
+            malValuePtr expansion = macro->apply(list->begin() + 1,
+                                                 list->end());
+            return analyze(expansion, env, scope);
+        }
+    }
+
+    return new Call(ast, analyze(list->item(0), env, scope),
+                    analyzeItems(list, 1, env, scope));
+}
+
+malCodePtr analyze(malValuePtr ast, const malEnvPtr& env, malScope* scope)
+{
+    try {
+        return analyzeForm(ast, env, scope);
+    }
+    catch (String& s) {
+        return new Throw(ast, s);
+    }
+    catch (malValuePtr& o) {
+        return new Throw(ast, o);
+    }
+}
+
+}
+
+malCodePtr analyze(malValuePtr ast, malEnvPtr env)
+{
+    return analyze(ast, env, NULL);
+}
+
+int malScope::find(malEnv::Id id) const
+{
+    for (int i = ids.size() - 1; i >= 0; i--) {
+        if (ids[i] == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void malScope::set(malEnv::Id id)
+{
+    if (find(id) < 0) {
+        ids.push_back(id);
+    }
+}
+
+void malScope::setParams(const malEnv::Params& params)
+{
+    int n = params.names.size();
+    for (int i = 0; i < n; i++) {
+        if (i == params.restIndex) {
+            if (i == n - 2) {
+                ids.push_back(params.names[n - 1].id());
+            }
+            break;
+        }
+        ids.push_back(params.names[i].id());
+    }
+}
+
+bool malScope::isPending(malEnv::Id id) const
+{
+    return std::find(pending.begin(), pending.end(), id) != pending.end();
+}
+
+bool malScope::resolve(const malScope* scope, malEnv::Id id,
+                       int& depth, int& slot)
+{
+    depth = 0;
+    for (const malScope* s = scope; s && !s->isPending(id);
+            s = s->outer, depth++) {
+        slot = s->find(id);
+        if (slot >= 0) {
+            return true;
+        }
+        if (s->open) {
+            break;
+        }
+    }
+    return false;
+}
+
+bool malScope::isLocal(const malScope* scope, malEnv::Id id)
+{
+    for (const malScope* s = scope; s; s = s->outer) {
+        if (s->isPending(id) || s->find(id) >= 0 || s->open) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const malLambda* findMacro(const malSymbol* sym, const malEnvPtr& env,
+                           const malScope* scope)
+{
+    if (malScope::isLocal(scope, sym->name().id())) {
+        return NULL;
+    }
+    malEnvPtr found = env->find(sym->value());
+    if (!found) {
+        return NULL;
+    }
+    const malLambda* lambda = DYNAMIC_CAST(malLambda,
+                                           found->get(sym->value()));
+    return lambda && lambda->isMacro() ? lambda : NULL;
+}
@@ -0,0 +1,68 @@
+#ifndef INCLUDE_ANALYZER_H
+#define INCLUDE_ANALYZER_H
+
+#include "MAL.h"
+#include "Environment.h"
+
+#include <vector>
+
+class malLambda;
+class malSymbol;
+
+// The analyze-then-execute mode. Each form is analyzed once into a tree
+// of malCode: constants, loads of local slots and cached globals, ifs,
+// calls and so on, with macros expanded along the way. Running the tree
+// no longer looks at the form. The bodies of fn* forms are analyzed with
+// the form around them, and lambdas made from them run that code.
+//
+// Macros are looked up in env. A call which turns out to be to a macro
+// when it runs is expanded and analyzed then instead.
+extern malCodePtr analyze(malValuePtr ast, malEnvPtr env);
+
+// What analysis knows of a frame which the code it makes will create:
+// the names in its slots, in order. The bytecode compiler (Bytecode.h)
+// shares this with the analyzer.
+class malScope {
+public:
+    malScope(malScope* outer, bool open) : outer(outer), open(open) { }
+
+    // The slot for id, searching backwards as malEnv does, or -1.
+    int find(malEnv::Id id) const;
+
+    // Adds a slot as malEnv::set does, reusing one already there.
+    void set(malEnv::Id id);
+
+    // Adds the slots a call's frame binds its parameters to.
+    void setParams(const malEnv::Params& params);
+
+    bool isPending(malEnv::Id id) const;
+
+    // Where code in scope will find id: true with the frame's depth and
+    // slot, or false if it has to look it up by name when it runs.
+    static bool resolve(const malScope* scope, malEnv::Id id,
+                        int& depth, int& slot);
+
+    // Whether code in scope could find id in a frame it makes, rather
+    // than in the environment it runs in.
+    static bool isLocal(const malScope* scope, malEnv::Id id);
+
+    malScope* const outer;
+    std::vector<malEnv::Id> ids;
+
+    // let* names which aren't bound yet, so closures made before they are
+    // have to look them up when they run.
+    std::vector<malEnv::Id> pending;
+
+    // Set when a def! may add a slot the analyzer didn't plan for, which
+    // could shadow anything further out.
+    bool open;
+};
+
+// The macro which the head of a call in scope names, if any.
+extern const malLambda* findMacro(const malSymbol* sym, const malEnvPtr& env,
+                                  const malScope* scope);
+
+// step*.cpp
+extern malValuePtr quasiquote(malValuePtr obj);
+
+#endif // INCLUDE_ANALYZER_H
@@ -0,0 +1,97 @@
+#ifndef INCLUDE_BYTECODE_H
+#define INCLUDE_BYTECODE_H
+
+#include "MAL.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// The bytecode back end. compile() turns a form into a malChunk, whose
+// instructions run on a stack machine (VM.cpp). Each fn* body is
+// compiled to a chunk of its own, which the lambdas made from it carry,
+// so calls from one chunk to another run in the same dispatch loop, and
+// tail calls reuse the caller's frame.
+//
+// Variables still live in malEnv frames, which closures capture, and are
+// resolved as the analyzer (Analyzer.h) does. Macros are expanded at
+// compile time. try* compiles to a handler table entry covering the
+// code of its body, which the machine consults when an error unwinds to
+// it, so entering a try* costs nothing.
+extern malCodePtr compile(malValuePtr ast, malEnvPtr env);
+
+// Each instruction is an op followed by its operands, all Words. Jump
+// targets are absolute.
+#define MAL_CHUNK_OPS(X) \
+    X(CONST)        /* k: push constant k */ \
+    X(LOCAL)        /* depth slot n: push a local, named by name n */ \
+    X(GLOBAL)       /* n: push the value of name n */ \
+    X(DEF)          /* n: bind name n to the top value, and keep it */ \
+    X(DEFMACRO)     /* n: as DEF, making the top value a macro */ \
+    X(POP)          /* drop the top value */ \
+    X(JUMP)         /* target */ \
+    X(JUMP_IF_FALSE) /* target: pop a value, and jump if it's false */ \
+    X(CLOSURE)      /* f: push a lambda for function f */ \
+    X(CHECK_MACRO)  /* k target: if the top value is a macro, expand */ \
+                    /* form k with it and push the result at target */ \
+    X(CALL)         /* n: call the function under n arguments */ \
+    X(TAIL_CALL)    /* n: as CALL, in place of this frame */ \
+    X(RETURN)       /* return the top value */ \
+    X(PUSH_ENV)     /* capacity: run in a new frame of the environment */ \
+    X(BIND)         /* n: pop a value, and bind name n to it */ \
+    X(POP_ENV)      /* go back to the frame's outer environment */ \
+    X(VECTOR)       /* n: push a vector of the top n values */ \
+    X(HASH)         /* k n: push a hash of keys k and the top n values */ \
+    X(THROW)        /* k isString: throw constant k */
+
+class malChunk : public malCode {
+public:
+    typedef uint16_t Word;
+
+#define MAL_CHUNK_OP_ENUM(op) op,
+    enum Op { MAL_CHUNK_OPS(MAL_CHUNK_OP_ENUM) OP_COUNT };
+#undef MAL_CHUNK_OP_ENUM
+
+    // What a CLOSURE instruction makes a lambda of.
+    struct Function {
+        malEnv::Params params;
+        malValuePtr body;
+        malCodePtr chunk;
+    };
+
+    // A try* whose body is the code in [start, end). An error there
+    // resets the stack to height and the environment to envDepth frames
+    // from the function's, then goes to target with the error pushed.
+    struct Handler {
+        int start;
+        int end;
+        int target;
+        int height;
+        int envDepth;
+    };
+
+    malChunk(malValuePtr source) : malCode(source, CHUNK), m_maxStack(0) { }
+
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const;
+    virtual malValuePtr eval(const malEnvPtr& env) const;
+
+    virtual void visitRefs(Visitor& visitor) const;
+    virtual void clearRefs();
+
+    std::vector<Word> m_code;
+    malValueVec m_constants;
+    std::vector<malEnv::Name> m_names;
+    mutable std::vector<malEnv::GlobalCache> m_caches; // one per name
+    std::vector<Function> m_functions;
+    std::vector<Handler> m_handlers; // innermost first
+
+    // The forms whose code starts at each pc, outermost first, in pc
+    // order, for DEBUG-EVAL.
+    std::vector<std::pair<int, malValuePtr> > m_forms;
+
+    int m_maxStack;
+};
+
+#endif // INCLUDE_BYTECODE_H
@@ -0,0 +1,148 @@
+#include "Collector.h"
+
+#include <algorithm>
+
+// The colours of objects during a collection. Everything else is WHITE.
+enum {
+    WHITE,
+    GRAY,       // reachable from the roots, maybe garbage
+    BLACK,      // reachable from the roots and referenced from outside
+};
+
+static const size_t MIN_THRESHOLD = 10000;
+
+Collector::Roots* Collector::s_roots;
+size_t Collector::s_threshold = MIN_THRESHOLD;
+
+void RefCounted::addPossibleRoot() const
+{
+    if (Collector::s_roots == NULL) {
+        Collector::s_roots = new Collector::Roots;
+    }
+    Collector::Roots& roots = *Collector::s_roots;
+    if (roots.size() >= (1u << 28) - 1) {
+        return; // no room to remember it, so it may leak
+    }
+    roots.push_back(this);
+    m_rootIndex = roots.size();
+}
+
+void RefCounted::removePossibleRoot() const
+{
+    (*Collector::s_roots)[m_rootIndex - 1] = NULL;
+    m_rootIndex = 0;
+}
+
+// Gives every object it visits which isn't acyclic and has colour from
+// the colour to, and pushes it onto a stack.
+class Collector::Marker : public RefCounted::Visitor {
+public:
+    Marker(unsigned from, unsigned to, Roots& stack)
+    : m_from(from), m_to(to), m_stack(stack) { }
+
+    virtual void visit(const RefCounted* object) {
+        if (!object->m_acyclic && object->m_color == m_from) {
+            object->m_color = m_to;
+            m_stack.push_back(object);
+        }
+    }
+
+    // Marks everything reachable from object which has colour from.
+    void markFrom(const RefCounted* object, Roots* marked = NULL) {
+        visit(object);
+        while (!m_stack.empty()) {
+            const RefCounted* next = m_stack.back();
+            m_stack.pop_back();
+            if (marked != NULL) {
+                marked->push_back(next);
+            }
+            next->visitRefs(*this);
+        }
+    }
+
+private:
+    const unsigned m_from;
+    const unsigned m_to;
+    Roots& m_stack;
+};
+
+// Adds delta to the count of every object it visits which is in the set
+// being collected.
+class Collector::Counter : public RefCounted::Visitor {
+public:
+    Counter(int delta) : m_delta(delta) { }
+
+    virtual void visit(const RefCounted* object) {
+        if (object->m_color != WHITE) {
+            object->m_refCount += m_delta;
+        }
+    }
+
+private:
+    const int m_delta;
+};
+
+int Collector::collect()
+{
+    if (s_roots == NULL) {
+        return 0;
+    }
+
+    // Objects which lose a reference from here on are possible roots of
+    // the next collection.
+    Roots roots;
+    roots.swap(*s_roots);
+    for (auto root : roots) {
+        if (root != NULL) {
+            root->m_rootIndex = 0;
+        }
+    }
+
+    // Find the set reachable from the roots.
+    Roots nodes, stack;
+    Marker gray(WHITE, GRAY, stack);
+    for (auto root : roots) {
+        if (root != NULL) {
+            gray.markFrom(root, &nodes);
+        }
+    }
+
+    // Take out the references from inside the set, then whatever still
+    // has references is live, along with everything it reaches.
+    Counter decrement(-1);
+    for (auto node : nodes) {
+        node->visitRefs(decrement);
+    }
+    Marker black(GRAY, BLACK, stack);
+    for (auto node : nodes) {
+        if (node->m_refCount > 0) {
+            black.markFrom(node);
+        }
+    }
+    Counter increment(1);
+    for (auto node : nodes) {
+        node->visitRefs(increment);
+    }
+
+    // Hold on to the garbage while its references are cleared, so that
+    // none of it is freed while it's still being cleared.
+    Roots garbage;
+    for (auto node : nodes) {
+        if (node->m_color == GRAY) {
+            node->acquire();
+            garbage.push_back(node);
+        }
+        node->m_color = WHITE;
+    }
+    for (auto node : garbage) {
+        const_cast<RefCounted*>(node)->clearRefs();
+    }
+    for (auto node : garbage) {
+        if (node->release() == 0) {
+            delete node;
+        }
+    }
+
+    s_threshold = std::max(MIN_THRESHOLD, nodes.size());
+    return garbage.size();
+}
@@ -0,0 +1,53 @@
+#ifndef INCLUDE_COLLECTOR_H
+#define INCLUDE_COLLECTOR_H
+
+#include "RefCountedPtr.h"
+
+#include <vector>
+
+// Reclaims the reference cycles which reference counting can't, such as
+// a closure held by the environment it captures, or an atom holding
+// something which refers back to it.
+//
+// It uses trial deletion (Bacon and Rajan, "Concurrent Cycle Collection
+// in Reference Counted Systems"). Whenever a reference count drops to a
+// value other than zero, the object might have just become garbage in a
+// cycle, so it is remembered as a possible root. A collection takes the
+// objects reachable from the possible roots, and subtracts from each
+// count the references which come from inside that set. Whatever is left
+// with a non-zero count is referenced from outside, and so is everything
+// it reaches. The rest is garbage: its references are cleared, which
+// lets reference counting free it.
+//
+// Only the references objects report through visitRefs are followed.
+// Objects marked acyclic hold none, so are never roots and are skipped.
+//
+// Collections only happen at safe points, at the top of each step's EVAL
+// loop and in the analyzed and compiled code. Every step which evaluates
+// must reach one: nothing else empties the possible roots, and they would
+// grow without bound, as a freed object only clears its slot. A collection
+// costs about as much as the set it traverses, so the next one waits until
+// at least as many possible roots have built up again.
+class Collector {
+public:
+    static void collectIfNeeded() {
+        if (s_roots != NULL && s_roots->size() >= s_threshold) {
+            collect();
+        }
+    }
+
+    // Returns the number of objects freed.
+    static int collect();
+
+private:
+    friend class RefCounted;
+
+    typedef std::vector<const RefCounted*> Roots;
+    static Roots* s_roots;
+    static size_t s_threshold;
+
+    class Marker;
+    class Counter;
+};
+
+#endif // INCLUDE_COLLECTOR_H
@@ -0,0 +1,479 @@
+#include "Analyzer.h"
+#include "Bytecode.h"
+#include "Environment.h"
+#include "Types.h"
+#include "Validation.h"
+
+#include <algorithm>
+
+namespace {
+
+// Emits the code for forms into one chunk.
+class Compiler {
+public:
+    Compiler(malChunk* chunk, const malEnvPtr& env)
+    : m_chunk(chunk), m_env(env), m_depth(0), m_envDepth(0)
+    {
+
+    }
+
+    void compile(malValuePtr ast, malScope* scope, bool tail);
+
+    void finish() {
+        emit(malChunk::RETURN, -1);
+    }
+
+private:
+    typedef malChunk::Word Word;
+
+    // Enough to undo the code emitted since it was taken.
+    struct Mark {
+        size_t code;
+        size_t forms;
+        size_t handlers;
+        int depth;
+        int envDepth;
+    };
+
+    void compileForm(malValuePtr ast, malScope* scope, bool tail);
+    void compileSymbol(const malSymbol* symbol, malScope* scope);
+    bool compileSpecial(const malList* list, malScope* scope, bool tail);
+    void compileCall(malValuePtr ast, malScope* scope, bool tail);
+    void compileFn(const malList* list, malScope* scope);
+    void compileLet(const malList* list, malScope* scope, bool tail);
+    void compileTry(const malList* list, malScope* scope, bool tail);
+    void compileItems(const malSequence* seq, int first, malScope* scope);
+
+    // Emits op, which changes the stack depth by delta.
+    void emit(malChunk::Op op, int delta) {
+        m_chunk->m_code.push_back(op);
+        m_depth += delta;
+        m_chunk->m_maxStack = std::max(m_chunk->m_maxStack, m_depth);
+    }
+
+    void emitOperand(int operand) {
+        MAL_CHECK(operand >= 0 && operand <= 0xffff,
+                  "form is too large to compile");
+        m_chunk->m_code.push_back(operand);
+    }
+
+    // Emits an operand for patch() to fill in later.
+    int emitPlaceholder() {
+        m_chunk->m_code.push_back(0);
+        return m_chunk->m_code.size() - 1;
+    }
+
+    void patch(int at, int operand) {
+        MAL_CHECK(operand >= 0 && operand <= 0xffff,
+                  "form is too large to compile");
+        m_chunk->m_code[at] = operand;
+    }
+
+    int here() const { return m_chunk->m_code.size(); }
+
+    int addConstant(malValuePtr value) {
+        m_chunk->m_constants.push_back(value);
+        return m_chunk->m_constants.size() - 1;
+    }
+
+    // Names get a slot each, so each use has a global cache of its own.
+    int addName(const malEnv::Name& name) {
+        m_chunk->m_names.push_back(name);
+        m_chunk->m_caches.push_back(malEnv::GlobalCache());
+        return m_chunk->m_names.size() - 1;
+    }
+
+    void emitConstant(malValuePtr value) {
+        emit(malChunk::CONST, 1);
+        emitOperand(addConstant(value));
+    }
+
+    Mark mark() const {
+        Mark mark = { m_chunk->m_code.size(), m_chunk->m_forms.size(),
+                      m_chunk->m_handlers.size(), m_depth, m_envDepth };
+        return mark;
+    }
+
+    void rollback(const Mark& mark) {
+        m_chunk->m_code.resize(mark.code);
+        m_chunk->m_forms.resize(mark.forms);
+        m_chunk->m_handlers.resize(mark.handlers);
+        m_depth = mark.depth;
+        m_envDepth = mark.envDepth;
+    }
+
+    malChunk* m_chunk;
+    const malEnvPtr& m_env;
+    int m_depth;    // of the stack, above the frame's base
+    int m_envDepth; // frames pushed since the function's own
+};
+
+// Forms which are their own value, with nothing inside to evaluate.
+bool isConstant(malValuePtr ast)
+{
+    if (ast.isImmediate()) {
+        return true;
+    }
+    if (value_is<malSymbol>(ast)) {
+        return false;
+    }
+    if (const malVector* vector = DYNAMIC_CAST(malVector, ast)) {
+        for (int i = 0, count = vector->count(); i < count; i++) {
+            if (!isConstant(vector->item(i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        return hash->isEvaluated();
+    }
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    return !list || list->isEmpty();
+}
+
+malCodePtr compileFunction(malValuePtr body, const malEnvPtr& env,
+                           malScope* scope)
+{
+    malChunk* chunk = new malChunk(body);
+    malCodePtr result(chunk);
+    Compiler compiler(chunk, env);
+    compiler.compile(body, scope, true);
+    compiler.finish();
+    return result;
+}
+
+void Compiler::compile(malValuePtr ast, malScope* scope, bool tail)
+{
+    Mark start = mark();
+    m_chunk->m_forms.push_back(std::make_pair(here(), ast));
+    try {
+        compileForm(ast, scope, tail);
+        return;
+    }
+    catch (String& s) {
+        rollback(start);
+        m_chunk->m_forms.push_back(std::make_pair(here(), ast));
+        // THROW doesn't return, but the code after it expects a value.
+        emit(malChunk::THROW, 1);
+        emitOperand(addConstant(mal::string(s)));
+        emitOperand(1);
+    }
+    catch (malValuePtr& o) {
+        rollback(start);
+        m_chunk->m_forms.push_back(std::make_pair(here(), ast));
+        emit(malChunk::THROW, 1);
+        emitOperand(addConstant(o));
+        emitOperand(0);
+    }
+}
+
+void Compiler::compileForm(malValuePtr ast, malScope* scope, bool tail)
+{
+    if (isConstant(ast)) {
+        emitConstant(ast);
+        return;
+    }
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, ast)) {
+        compileSymbol(symbol, scope);
+        return;
+    }
+    if (const malVector* vector = DYNAMIC_CAST(malVector, ast)) {
+        compileItems(vector, 0, scope);
+        emit(malChunk::VECTOR, 1 - vector->count());
+        emitOperand(vector->count());
+        return;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        malValuePtr values = hash->values();
+        const malSequence* seq = STATIC_CAST(malSequence, values);
+        compileItems(seq, 0, scope);
+        emit(malChunk::HASH, 1 - seq->count());
+        emitOperand(addConstant(hash->keys()));
+        emitOperand(seq->count());
+        return;
+    }
+
+    const malList* list = STATIC_CAST(malList, ast);
+    if (!compileSpecial(list, scope, tail)) {
+        compileCall(ast, scope, tail);
+    }
+}
+
+void Compiler::compileSymbol(const malSymbol* symbol, malScope* scope)
+{
+    int depth, slot;
+    if (malScope::resolve(scope, symbol->name().id(), depth, slot)) {
+        emit(malChunk::LOCAL, 1);
+        emitOperand(depth);
+        emitOperand(slot);
+    }
+    else {
+        emit(malChunk::GLOBAL, 1);
+    }
+    emitOperand(addName(symbol->name()));
+}
+
+void Compiler::compileItems(const malSequence* seq, int first,
+                            malScope* scope)
+{
+    for (int i = first; i < seq->count(); i++) {
+        compile(seq->item(i), scope, false);
+    }
+}
+
+bool Compiler::compileSpecial(const malList* list, malScope* scope,
+                              bool tail)
+{
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (!symbol || symbol->specialForm() == malSymbol::NONE) {
+        return false;
+    }
+    int argCount = list->count() - 1;
+
+    switch (symbol->specialForm()) {
+    case malSymbol::DEF:
+    case malSymbol::DEFMACRO: {
+        bool isMacro = symbol->specialForm() == malSymbol::DEFMACRO;
+        checkArgsIs(isMacro ? "defmacro!" : "def!", 2, argCount);
+        const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+        if (scope && scope->find(id->name().id()) < 0) {
+            scope->open = true;
+        }
+        compile(list->item(2), scope, false);
+        emit(isMacro ? malChunk::DEFMACRO : malChunk::DEF, 0);
+        emitOperand(addName(id->name()));
+        return true;
+    }
+
+    case malSymbol::DO:
+        checkArgsAtLeast("do", 1, argCount);
+        for (int i = 1; i < argCount; i++) {
+            compile(list->item(i), scope, false);
+            emit(malChunk::POP, -1);
+        }
+        compile(list->item(argCount), scope, tail);
+        return true;
+
+    case malSymbol::FN:
+        compileFn(list, scope);
+        return true;
+
+    case malSymbol::IF: {
+        checkArgsBetween("if", 2, 3, argCount);
+        compile(list->item(1), scope, false);
+        emit(malChunk::JUMP_IF_FALSE, -1);
+        int toElse = emitPlaceholder();
+        compile(list->item(2), scope, tail);
+        emit(malChunk::JUMP, -1);
+        int toEnd = emitPlaceholder();
+        patch(toElse, here());
+        if (argCount == 3) {
+            compile(list->item(3), scope, tail);
+        }
+        else {
+            emitConstant(mal::nilValue());
+        }
+        patch(toEnd, here());
+        return true;
+    }
+
+    case malSymbol::LET:
+        compileLet(list, scope, tail);
+        return true;
+
+    case malSymbol::QUASIQUOTE:
+        checkArgsIs("quasiquote", 1, argCount);
+        compile(quasiquote(list->item(1)), scope, tail);
+        return true;
+
+    case malSymbol::QUOTE:
+        checkArgsIs("quote", 1, argCount);
+        emitConstant(list->item(1));
+        return true;
+
+    case malSymbol::TRY:
+        compileTry(list, scope, tail);
+        return true;
+
+    case malSymbol::NONE:
+        break;
+    }
+    return false;
+}
+
+void Compiler::compileFn(const malList* list, malScope* scope)
+{
+    checkArgsIs("fn*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    StringVec names;
+    for (int i = 0; i < bindings->count(); i++) {
+        const malSymbol* sym = VALUE_CAST(malSymbol, bindings->item(i));
+        names.push_back(sym->value());
+    }
+    malChunk::Function function = { malEnv::Params(names), list->item(2) };
+
+    // Compile the body again as an open scope if it turns out to need one.
+    for (bool open = false; ; open = true) {
+        malScope inner(scope, open);
+        inner.setParams(function.params);
+        function.chunk = compileFunction(function.body, m_env, &inner);
+        if (!inner.open || open) {
+            break;
+        }
+    }
+
+    m_chunk->m_functions.push_back(function);
+    emit(malChunk::CLOSURE, 1);
+    emitOperand(m_chunk->m_functions.size() - 1);
+}
+
+void Compiler::compileLet(const malList* list, malScope* scope, bool tail)
+{
+    checkArgsIs("let*", 2, list->count() - 1);
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+
+    std::vector<malEnv::Name> names;
+    for (int i = 0; i < count; i += 2) {
+        names.push_back(VALUE_CAST(malSymbol, bindings->item(i))->name());
+    }
+
+    Mark start = mark();
+    for (bool open = false; ; open = true) {
+        malScope inner(scope, open);
+        for (auto it = names.begin(), end = names.end(); it != end; ++it) {
+            inner.pending.push_back(it->id());
+        }
+
+        emit(malChunk::PUSH_ENV, 0);
+        int capacity = emitPlaceholder();
+        m_envDepth++;
+        for (int i = 0; i < count / 2; i++) {
+            compile(bindings->item(2 * i + 1), &inner, false);
+            emit(malChunk::BIND, -1);
+            emitOperand(addName(names[i]));
+            inner.set(names[i].id());
+            inner.pending.erase(std::find(inner.pending.begin(),
+                                          inner.pending.end(),
+                                          names[i].id()));
+        }
+        compile(list->item(2), &inner, tail);
+        emit(malChunk::POP_ENV, 0);
+        m_envDepth--;
+
+        if (!inner.open || open) {
+            patch(capacity, inner.ids.size());
+            return;
+        }
+        rollback(start);
+    }
+}
+
+void Compiler::compileTry(const malList* list, malScope* scope, bool tail)
+{
+    int argCount = list->count() - 1;
+    if (argCount == 1) {
+        compile(list->item(1), scope, tail);
+        return;
+    }
+    checkArgsIs("try*", 2, argCount);
+    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+    MAL_CHECK(VALUE_CAST(malSymbol,
+        catchBlock->item(0))->value() == "catch*",
+        "catch block must begin with catch*");
+
+    const malSymbol* excSym = VALUE_CAST(malSymbol, catchBlock->item(1));
+
+    Mark start = mark();
+    for (bool open = false; ; open = true) {
+        malChunk::Handler handler = { here(), 0, 0, m_depth, m_envDepth };
+
+        // The body's calls aren't tail calls, as the handler has to stay.
+        compile(list->item(1), scope, false);
+        handler.end = here();
+        emit(malChunk::JUMP, -1);
+        int toEnd = emitPlaceholder();
+
+        handler.target = here();
+        m_depth = handler.height + 1;
+        malScope inner(scope, open);
+        inner.ids.push_back(excSym->name().id());
+        emit(malChunk::PUSH_ENV, 0);
+        emitOperand(1);
+        m_envDepth++;
+        emit(malChunk::BIND, -1);
+        emitOperand(addName(excSym->name()));
+        compile(catchBlock->item(2), &inner, tail);
+        emit(malChunk::POP_ENV, 0);
+        m_envDepth--;
+        patch(toEnd, here());
+
+        if (!inner.open || open) {
+            m_chunk->m_handlers.push_back(handler);
+            return;
+        }
+        rollback(start);
+    }
+}
+
+void Compiler::compileCall(malValuePtr ast, malScope* scope, bool tail)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (symbol) {
+        if (const malLambda* macro = findMacro(symbol, m_env, scope)) {
+            compile(macro->apply(list->begin() + 1, list->end()), scope,
+                    tail);
+            return;
+        }
+    }
+
+    int argCount = list->count() - 1;
+    compile(list->item(0), scope, false);
+    emit(malChunk::CHECK_MACRO, 0);
+    emitOperand(addConstant(ast));
+    int toEnd = emitPlaceholder();
+    compileItems(list, 1, scope);
+    emit(tail ? malChunk::TAIL_CALL : malChunk::CALL, -argCount);
+    emitOperand(argCount);
+    patch(toEnd, here());
+}
+
+}
+
+malCodePtr compile(malValuePtr ast, malEnvPtr env)
+{
+    return compileFunction(ast, env, NULL);
+}
+
+malValuePtr malChunk::step(malEnvPtr& env, malCodePtr& next) const
+{
+    return eval(env);
+}
+
+void malChunk::visitRefs(Visitor& visitor) const
+{
+    malCode::visitRefs(visitor);
+    for (auto it = m_constants.begin(); it != m_constants.end(); ++it) {
+        visitRef(visitor, *it);
+    }
+    for (auto it = m_functions.begin(); it != m_functions.end(); ++it) {
+        visitRef(visitor, it->body);
+        visitRef(visitor, it->chunk);
+    }
+    for (auto it = m_forms.begin(); it != m_forms.end(); ++it) {
+        visitRef(visitor, it->second);
+    }
+}
+
+void malChunk::clearRefs()
+{
+    malCode::clearRefs();
+    m_constants.clear();
+    m_functions.clear();
+    m_forms.clear();
+}
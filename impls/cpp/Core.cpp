@@ -1,5 +1,8 @@
 #include "MAL.h"
+#include "Collector.h"
 #include "Environment.h"
+#include "MacroCache.h"
+#include "Pool.h"
 #include "StaticList.h"
 #include "Types.h"
 
@@ -25,6 +28,7 @@ static String printValues(malValueIter begin, malValueIter end,
 static StaticList<malBuiltIn*> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define INT_ARG(name) int64_t name = integer_value(*argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
@@ -40,7 +44,7 @@ static StaticList<malBuiltIn*> handlers;
 #define BUILTIN_ISA(symbol, type) \
     BUILTIN(symbol) { \
         CHECK_ARGS_IS(1); \
-        return mal::boolean(DYNAMIC_CAST(type, *argsBegin)); \
+        return mal::boolean(value_is<type>(*argsBegin)); \
     }
 
 #define BUILTIN_IS(op, constant) \
@@ -52,12 +56,12 @@ static StaticList<malBuiltIn*> handlers;
 #define BUILTIN_INTOP(op, checkDivByZero) \
     BUILTIN(#op) { \
         CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
+        INT_ARG(lhs); \
+        INT_ARG(rhs); \
         if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+            MAL_CHECK(rhs != 0, "Division by zero"); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        return mal::integer(lhs op rhs); \
     }
 
 BUILTIN_ISA("atom?",        malAtom);
@@ -82,73 +86,97 @@ BUILTIN_IS("nil?",          nilValue);
 BUILTIN("-")
 {
     int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
+    INT_ARG(lhs);
     if (argCount == 1) {
-        return mal::integer(- lhs->value());
+        return mal::integer(- lhs);
     }
 
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
+    INT_ARG(rhs);
+    return mal::integer(lhs - rhs);
 }
 
 BUILTIN("<=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    INT_ARG(lhs);
+    INT_ARG(rhs);
 
-    return mal::boolean(lhs->value() <= rhs->value());
+    return mal::boolean(lhs <= rhs);
 }
 
 BUILTIN(">=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    INT_ARG(lhs);
+    INT_ARG(rhs);
 
-    return mal::boolean(lhs->value() >= rhs->value());
+    return mal::boolean(lhs >= rhs);
 }
 
 BUILTIN("<")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    INT_ARG(lhs);
+    INT_ARG(rhs);
 
-    return mal::boolean(lhs->value() < rhs->value());
+    return mal::boolean(lhs < rhs);
 }
 
 BUILTIN(">")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    INT_ARG(lhs);
+    INT_ARG(rhs);
 
-    return mal::boolean(lhs->value() > rhs->value());
+    return mal::boolean(lhs > rhs);
 }
 
 BUILTIN("=")
 {
     CHECK_ARGS_IS(2);
+    if (argsBegin[0].isImmediate() && argsBegin[1].isImmediate()) {
+        return mal::boolean(argsBegin[0] == argsBegin[1]);
+    }
+
     const malValue* lhs = (*argsBegin++).ptr();
     const malValue* rhs = (*argsBegin++).ptr();
 
     return mal::boolean(lhs->isEqualTo(rhs));
 }
 
+// Counts from the object pool, for measuring allocations per evaluation.
+BUILTIN("alloc-stats")
+{
+    CHECK_ARGS_IS(0);
+    const Pool::Stats& stats = Pool::stats();
+
+    malValueVec items;
+    items.push_back(mal::keyword(":allocations"));
+    items.push_back(mal::integer(stats.allocations));
+    items.push_back(mal::keyword(":frees"));
+    items.push_back(mal::integer(stats.frees));
+    items.push_back(mal::keyword(":live"));
+    items.push_back(mal::integer(stats.allocations - stats.frees));
+    items.push_back(mal::keyword(":pooled-bytes"));
+    items.push_back(mal::integer(stats.chunkBytes));
+
+    return mal::hash(items.begin(), items.end(), true);
+}
+
 BUILTIN("apply")
 {
     CHECK_ARGS_AT_LEAST(2);
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
+    const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
+    int argCount = std::distance(argsBegin, argsEnd) - 1;
+    malArgs args(argCount + lastArg->count());
+
     // Copy the first N-1 arguments in.
-    malValueVec args(argsBegin, argsEnd-1);
+    std::copy(argsBegin, argsEnd-1, args.begin());
 
     // Then append the argument as a list.
-    const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
-    for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
-    }
+    lastArg->copyItems(args.begin() + argCount);
 
     return APPLY(op, args.begin(), args.end());
 }
@@ -156,6 +184,10 @@ BUILTIN("apply")
 BUILTIN("assoc")
 {
     CHECK_ARGS_AT_LEAST(1);
+    if (const malVector* vector = DYNAMIC_CAST(malVector, *argsBegin)) {
+        ++argsBegin;
+        return vector->assoc(argsBegin, argsEnd);
+    }
     ARG(malHash, hash);
 
     return hash->assoc(argsBegin, argsEnd);
@@ -170,21 +202,27 @@ BUILTIN("atom")
 
 BUILTIN("concat")
 {
+    if (argsBegin == argsEnd) {
+        return mal::list(new malValueVec(0));
+    }
+
     int count = 0;
     for (auto it = argsBegin; it != argsEnd; ++it) {
         const malSequence* seq = VALUE_CAST(malSequence, *it);
         count += seq->count();
     }
 
-    malValueVec* items = new malValueVec(count);
-    int offset = 0;
-    for (auto it = argsBegin; it != argsEnd; ++it) {
+    // The last sequence's items are shared, the others are copied in
+    // front of them.
+    const malSequence* last = STATIC_CAST(malSequence, *(argsEnd - 1));
+    malList* list = last->withFront(count - last->count());
+    malValueIter out = list->begin();
+    for (auto it = argsBegin; it != argsEnd - 1; ++it) {
         const malSequence* seq = STATIC_CAST(malSequence, *it);
-        std::copy(seq->begin(), seq->end(), items->begin() + offset);
-        offset += seq->count();
+        out = seq->copyItems(out);
     }
 
-    return mal::list(items);
+    return list;
 }
 
 BUILTIN("conj")
@@ -201,11 +239,9 @@ BUILTIN("cons")
     malValuePtr first = *argsBegin++;
     ARG(malSequence, rest);
 
-    malValueVec* items = new malValueVec(1 + rest->count());
-    items->at(0) = first;
-    std::copy(rest->begin(), rest->end(), items->begin() + 1);
-
-    return mal::list(items);
+    malList* list = rest->withFront(1);
+    *list->begin() = first;
+    return list;
 }
 
 BUILTIN("contains?")
@@ -282,6 +318,13 @@ BUILTIN("fn?")
     return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
 }
 
+// Runs the cycle collector now, and returns how many objects it freed.
+BUILTIN("gc")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(Collector::collect());
+}
+
 BUILTIN("get")
 {
     CHECK_ARGS_IS(2);
@@ -320,6 +363,22 @@ BUILTIN("list")
     return mal::list(argsBegin, argsEnd);
 }
 
+// Counts from the macro expansion cache (MacroCache.h): how many macro
+// calls were expanded, and how many reused an earlier expansion.
+BUILTIN("macro-stats")
+{
+    CHECK_ARGS_IS(0);
+    const MacroCache::Stats& stats = MacroCache::stats();
+
+    malValueVec items;
+    items.push_back(mal::keyword(":expansions"));
+    items.push_back(mal::integer(stats.expansions));
+    items.push_back(mal::keyword(":avoided"));
+    items.push_back(mal::integer(stats.avoided));
+
+    return mal::hash(items.begin(), items.end(), true);
+}
+
 BUILTIN("macro?")
 {
     CHECK_ARGS_IS(1);
@@ -337,7 +396,9 @@ BUILTIN("map")
 
     const int length = source->count();
     malValueVec* items = new malValueVec(length);
-    auto it = source->begin();
+    malArgs args(length);
+    auto it = args.begin();
+    source->copyItems(it);
     for (int i = 0; i < length; i++) {
       items->at(i) = APPLY(op, it+i, it+i+1);
     }
@@ -357,9 +418,9 @@ BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
     ARG(malSequence, seq);
-    ARG(malInteger,  index);
+    INT_ARG(index);
 
-    int i = index->value();
+    int i = index;
     MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
 
     return seq->item(i);
@@ -423,8 +484,12 @@ BUILTIN("seq")
         return mal::nilValue();
     }
     if (const malSequence* seq = DYNAMIC_CAST(malSequence, arg)) {
-        return seq->isEmpty() ? mal::nilValue()
-                              : mal::list(seq->begin(), seq->end());
+        if (seq->isEmpty()) {
+            return mal::nilValue();
+        }
+        malValueVec* items = new malValueVec(seq->count());
+        seq->copyItems(items->begin());
+        return mal::list(items);
     }
     if (const malString* strVal = DYNAMIC_CAST(malString, arg)) {
         const String str = strVal->value();
@@ -473,7 +538,7 @@ BUILTIN("swap!")
 
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    malValueVec args(1 + argsEnd - argsBegin);
+    malArgs args(1 + argsEnd - argsBegin);
     args[0] = atom->deref();
     std::copy(argsBegin, argsEnd, args.begin() + 1);
 
@@ -517,7 +582,13 @@ BUILTIN("vec")
 {
     CHECK_ARGS_IS(1);
     ARG(malSequence, s);
-    return mal::vector(s->begin(), s->end());
+    const malVector* vector = DYNAMIC_CAST(malVector, s);
+    if (vector && !vector->isFlat()) {
+        return mal::vector(vector->items());
+    }
+    malValueVec* items = new malValueVec(s->count());
+    s->copyItems(items->begin());
+    return mal::vector(items);
 }
 
 BUILTIN("vector")
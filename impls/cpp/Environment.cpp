@@ -3,28 +3,121 @@
 
 #include <algorithm>
 
-malEnv::malEnv(malEnvPtr outer)
+int malEnv::s_debugEvalFrames;
+unsigned malEnv::s_rootCount;
+unsigned malEnv::s_globalVersion = 1;
+
+namespace {
+    struct Names {
+        std::unordered_map<String, malEnv::Id> ids;
+        StringVec names;
+        std::vector<int> refs;
+        std::vector<bool> boundLocally;
+        std::vector<bool> cachedGlobally;
+        std::vector<malEnv::Id> unused;
+    };
+
+    Names* names;
+
+    const malEnv::Name& debugEvalName()
+    {
+        static const malEnv::Name name("DEBUG-EVAL");
+        return name;
+    }
+}
+
+malEnv::Id malEnv::Name::intern(const String& name)
+{
+    if (names == NULL) {
+        names = new Names;
+    }
+    auto it = names->ids.find(name);
+    if (it != names->ids.end()) {
+        acquire(it->second);
+        return it->second;
+    }
+
+    Id id;
+    if (!names->unused.empty()) {
+        id = names->unused.back();
+        names->unused.pop_back();
+        names->names[id] = name;
+        names->refs[id] = 1;
+        names->boundLocally[id] = false;
+        names->cachedGlobally[id] = false;
+    }
+    else {
+        id = names->names.size();
+        names->names.push_back(name);
+        names->refs.push_back(1);
+        names->boundLocally.push_back(false);
+        names->cachedGlobally.push_back(false);
+    }
+    names->ids[name] = id;
+    return id;
+}
+
+void malEnv::Name::acquire(Id id)
+{
+    names->refs[id]++;
+}
+
+void malEnv::Name::release(Id id)
+{
+    if (--names->refs[id] == 0) {
+        names->ids.erase(names->names[id]);
+        names->names[id].clear();
+        names->unused.push_back(id);
+    }
+}
+
+const String& malEnv::Name::str() const
+{
+    return names->names[m_id];
+}
+
+malEnv::Params::Params(const StringVec& bindings)
+: restIndex(-1)
+{
+    names.reserve(bindings.size());
+    for (auto it = bindings.begin(), end = bindings.end(); it != end; ++it) {
+        if (*it == "&" && restIndex < 0) {
+            restIndex = names.size();
+        }
+        names.push_back(Name(*it));
+    }
+}
+
+malEnv::malEnv(malEnvPtr outer, int capacity)
 : m_outer(outer)
+, m_root(outer ? 0 : ++s_rootCount)
+, m_rootOfChain(outer ? outer->m_rootOfChain : m_root)
+, m_bindsDebugEval(false)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    m_slots.reserve(capacity);
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
+malEnv::malEnv(malEnvPtr outer, const Params& params,
                malValueIter argsBegin, malValueIter argsEnd)
 : m_outer(outer)
+, m_root(0)
+, m_rootOfChain(outer->m_rootOfChain)
+, m_bindsDebugEval(false)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
-    int n = bindings.size();
+    int n = params.names.size();
+    m_slots.reserve(n);
     auto it = argsBegin;
     for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
+        if (i == params.restIndex) {
             MAL_CHECK(i == n - 2, "There must be one parameter after the &");
 
-            set(bindings[n-1], mal::list(it, argsEnd));
+            bind(params.names[n-1], mal::list(it, argsEnd));
             return;
         }
         MAL_CHECK(it != argsEnd, "Not enough parameters");
-        set(bindings[i], *it);
+        bind(params.names[i], *it);
         ++it;
     }
     MAL_CHECK(it == argsEnd, "Too many parameters");
@@ -33,12 +126,82 @@ malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
 malEnv::~malEnv()
 {
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
+    if (m_bindsDebugEval) {
+        s_debugEvalFrames--;
+    }
+}
+
+void malEnv::visitRefs(Visitor& visitor) const
+{
+    for (auto it = m_slots.begin(), end = m_slots.end(); it != end; ++it) {
+        visitRef(visitor, it->value);
+    }
+    for (auto it = m_globals.begin(), end = m_globals.end(); it != end; ++it) {
+        visitRef(visitor, it->second.value);
+    }
+    visitRef(visitor, m_outer);
+}
+
+void malEnv::clearRefs()
+{
+    m_slots.clear();
+    m_globals.clear();
+    m_outer = NULL;
+}
+
+// Later bindings of a name shadow earlier ones, so search backwards.
+malValuePtr* malEnv::lookup(Id id)
+{
+    if (m_root) {
+        auto it = m_globals.find(id);
+        return it != m_globals.end() ? &it->second.value : NULL;
+    }
+    for (auto it = m_slots.rbegin(), end = m_slots.rend(); it != end; ++it) {
+        if (it->name.id() == id) {
+            return &it->value;
+        }
+    }
+    return NULL;
+}
+
+// Adds a binding without looking for an existing one.
+void malEnv::bind(const Name& name, malValuePtr value)
+{
+    if (name.id() == debugEvalName().id() && !m_bindsDebugEval) {
+        m_bindsDebugEval = true;
+        s_debugEvalFrames++;
+    }
+    Slot slot = { name, value };
+    if (m_root) {
+        m_globals.insert(std::make_pair(name.id(), slot));
+    }
+    else {
+        if (!names->boundLocally[name.id()]) {
+            names->boundLocally[name.id()] = true;
+            if (names->cachedGlobally[name.id()]) {
+                s_globalVersion++;
+            }
+        }
+        m_slots.push_back(slot);
+    }
+}
+
+bool malEnv::lookupDebugEval() const
+{
+    for (malEnv* env = const_cast<malEnv*>(this); env;
+            env = env->m_outer.ptr()) {
+        if (malValuePtr* value = env->lookup(debugEvalName().id())) {
+            return value->isTrue();
+        }
+    }
+    return false;
 }
 
 malEnvPtr malEnv::find(const String& symbol)
 {
+    Name name(symbol);
     for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+        if (env->lookup(name.id())) {
             return env;
         }
     }
@@ -47,18 +210,52 @@ malEnvPtr malEnv::find(const String& symbol)
 
 malValuePtr malEnv::get(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    GlobalCache cache;
+    return get(Name(symbol).id(), cache);
+}
+
+malValuePtr malEnv::get(Id id, GlobalCache& cache)
+{
+    if (cache.version == s_globalVersion && cache.root == m_rootOfChain) {
+        return *cache.cell;
+    }
+
+    malEnv* env = this;
+    for ( ; !env->m_root; env = env->m_outer.ptr()) {
+        if (malValuePtr* value = env->lookup(id)) {
+            return *value;
         }
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+
+    if (cache.root != env->m_root) {
+        malValuePtr* cell = env->lookup(id);
+        MAL_CHECK(cell != NULL, "'%s' not found", names->names[id].c_str());
+        cache.root = env->m_root;
+        cache.cell = cell;
+    }
+    if (names->boundLocally[id]) {
+        cache.version = 0;
+    }
+    else {
+        names->cachedGlobally[id] = true;
+        cache.version = s_globalVersion;
+    }
+    return *cache.cell;
 }
 
 malValuePtr malEnv::set(const String& symbol, malValuePtr value)
 {
-    m_map[symbol] = value;
+    return set(Name(symbol), value);
+}
+
+malValuePtr malEnv::set(const Name& name, malValuePtr value)
+{
+    if (malValuePtr* existing = lookup(name.id())) {
+        *existing = value;
+    }
+    else {
+        bind(name, value);
+    }
     return value;
 }
 
@@ -3,27 +3,135 @@
 
 #include "MAL.h"
 
-#include <map>
+#include <unordered_map>
 
+// Local frames, made by fn* calls, let* and catch*, keep their variables
+// in a small array, in the order they were bound, and compare names as
+// interned ids. The root frame holds the globals in a hash table, whose
+// cells never move, so a lookup can cache the cell it found.
 class malEnv : public RefCounted {
 public:
-    malEnv(malEnvPtr outer = NULL);
+    typedef int Id;
+
+    // An interned name. Every holder of an id holds a Name, so that an id
+    // can be reused once its name is no longer used, and gensyms don't
+    // pile up in the table.
+    class Name {
+    public:
+        explicit Name(const String& name) : m_id(intern(name)) { }
+        Name(const Name& that) : m_id(that.m_id) { acquire(m_id); }
+        ~Name() { release(m_id); }
+
+        Name& operator = (const Name& that) {
+            acquire(that.m_id);
+            release(m_id);
+            m_id = that.m_id;
+            return *this;
+        }
+
+        Id id() const { return m_id; }
+        const String& str() const;
+
+    private:
+        static Id intern(const String& name);
+        static void acquire(Id id);
+        static void release(Id id);
+
+        Id m_id;
+    };
+
+    // The cell a global lookup last found, for the next lookup of the same
+    // name, which keeps one for each place the name is used. It is used
+    // once the search gets to the same root frame, and straight away,
+    // without searching the local frames, while version is the current
+    // globalVersion(): a name no local frame has ever bound can't be
+    // shadowed.
+    struct GlobalCache {
+        GlobalCache() : root(0), version(0), cell(NULL) { }
+
+        unsigned root;
+        unsigned version;
+        malValuePtr* cell;
+    };
+
+    // The parameters of a fn*, interned once when it is made. The frame of
+    // a call binds them in this order.
+    struct Params {
+        Params(const StringVec& bindings);
+
+        std::vector<Name> names;
+        int restIndex; // of the "&", or -1
+    };
+
+    malEnv(malEnvPtr outer = NULL, int capacity = 0);
     malEnv(malEnvPtr outer,
-           const StringVec& bindings,
+           const Params& params,
            malValueIter argsBegin,
            malValueIter argsEnd);
 
     ~malEnv();
 
     malValuePtr get(const String& symbol);
+    malValuePtr get(Id id, GlobalCache& cache);
     malEnvPtr   find(const String& symbol);
     malValuePtr set(const String& symbol, malValuePtr value);
+    malValuePtr set(const Name& name, malValuePtr value);
     malEnvPtr   getRoot();
+    malEnvPtr   getOuter() const { return m_outer; }
+
+    // For analyzed code, which knows where a local should be: the value in
+    // slot index of the frame depth frames out, if it holds the name id.
+    malValuePtr* slot(int depth, int index, Id id) {
+        malEnv* env = this;
+        while (depth--) {
+            env = env->m_outer.ptr();
+        }
+        if (index < (int)env->m_slots.size() &&
+                env->m_slots[index].name.id() == id) {
+            return &env->m_slots[index].value;
+        }
+        return NULL;
+    }
+
+    // Whether DEBUG-EVAL is true here. Unless some frame binds DEBUG-EVAL,
+    // this is a single read of a global count.
+    bool debugEval() const {
+        return mayDebugEval() && lookupDebugEval();
+    }
+
+    // Whether any frame binds DEBUG-EVAL, without which debugEval() is
+    // false everywhere.
+    static bool mayDebugEval() { return s_debugEvalFrames != 0; }
+
+    // Moves on whenever a local frame first binds a name which lookups
+    // have cached as a global, as it may now shadow it.
+    static unsigned globalVersion() { return s_globalVersion; }
+
+    virtual void visitRefs(Visitor& visitor) const;
+    virtual void clearRefs();
 
 private:
-    typedef std::map<String, malValuePtr> Map;
-    Map m_map;
+    struct Slot {
+        Name name;
+        malValuePtr value;
+    };
+    typedef std::vector<Slot> Slots;
+    typedef std::unordered_map<Id, Slot> Globals;
+
+    malValuePtr* lookup(Id id);
+    void bind(const Name& name, malValuePtr value);
+    bool lookupDebugEval() const;
+
+    static int s_debugEvalFrames;
+    static unsigned s_rootCount;
+    static unsigned s_globalVersion;
+
     malEnvPtr m_outer;
+    Slots m_slots;
+    Globals m_globals;
+    const unsigned m_root; // non-zero, and unique, for root frames
+    const unsigned m_rootOfChain; // the m_root of this frame's root
+    bool m_bindsDebugEval;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
@@ -0,0 +1,308 @@
+#ifndef INCLUDE_HASHTRIE_H
+#define INCLUDE_HASHTRIE_H
+
+#include "RefCountedPtr.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A persistent hash array mapped trie. Updates return a new trie which
+// shares every node off the path to the changed entry with the old one,
+// so they cost O(log32 n) and never copy the whole map.
+//
+// Each node uses 5 bits of the hash to index up to 32 slots, which are
+// either entries or child nodes, kept in two packed arrays with a bitmap
+// each (as in CHAMP). Once the hash bits run out, a node just holds its
+// colliding entries in a list.
+//
+// Traits supplies hash(key) and equal(key, key). Hashes are stored in
+// the entries, so each key is hashed once per update or lookup.
+template<typename K, typename V, typename Traits>
+class HashTrie {
+public:
+    HashTrie() : m_size(0) { }
+
+    size_t size() const { return m_size; }
+
+    const V* find(const K& key) const {
+        return m_root ? m_root->find(key, Traits::hash(key), 0) : NULL;
+    }
+
+    HashTrie insert(const K& key, const V& value) const {
+        Entry entry = { Traits::hash(key), key, value };
+        if (!m_root) {
+            return HashTrie(Node::single(entry), 1);
+        }
+        bool added = false;
+        NodePtr root = m_root->insert(entry, 0, added);
+        return HashTrie(root, m_size + (added ? 1 : 0));
+    }
+
+    HashTrie erase(const K& key) const {
+        if (!m_root) {
+            return *this;
+        }
+        bool removed = false;
+        NodePtr root = m_root->erase(key, Traits::hash(key), 0, removed);
+        return HashTrie(root, m_size - (removed ? 1 : 0));
+    }
+
+    // Calls f(key, value) for each entry, in hash order.
+    template<typename F>
+    void forEach(F f) const {
+        if (m_root) {
+            m_root->forEach(f);
+        }
+    }
+
+    // For the cycle collector: the trie's nodes report their own
+    // references, and keys and values are visited with visitRef.
+    void visitRefs(RefCounted::Visitor& visitor) const {
+        visitRef(visitor, m_root);
+    }
+
+private:
+    struct Entry {
+        size_t hash;
+        K key;
+        V value;
+    };
+
+    class Node;
+    typedef RefCountedPtr<const Node> NodePtr;
+
+    static const unsigned BITS = 5;
+    static const unsigned HASH_BITS = 8 * sizeof(size_t);
+
+    class Node : public RefCounted {
+    public:
+        Node() : m_dataMap(0), m_nodeMap(0) { }
+
+        static NodePtr single(const Entry& entry) {
+            Node* node = new Node;
+            node->m_dataMap = bit(entry.hash, 0);
+            node->m_entries.push_back(entry);
+            return node;
+        }
+
+        const V* find(const K& key, size_t hash, unsigned shift) const {
+            if (shift >= HASH_BITS) {
+                for (auto& entry : m_entries) {
+                    if (Traits::equal(entry.key, key)) {
+                        return &entry.value;
+                    }
+                }
+                return NULL;
+            }
+
+            uint32_t b = bit(hash, shift);
+            if (m_dataMap & b) {
+                const Entry& entry = m_entries[index(m_dataMap, b)];
+                return (entry.hash == hash && Traits::equal(entry.key, key))
+                    ? &entry.value : NULL;
+            }
+            if (m_nodeMap & b) {
+                return m_nodes[index(m_nodeMap, b)]->find(key, hash,
+                                                          shift + BITS);
+            }
+            return NULL;
+        }
+
+        NodePtr insert(const Entry& entry, unsigned shift,
+                       bool& added) const {
+            Node* node = new Node(*this);
+
+            if (shift >= HASH_BITS) {
+                for (auto& e : node->m_entries) {
+                    if (Traits::equal(e.key, entry.key)) {
+                        e.value = entry.value;
+                        return node;
+                    }
+                }
+                node->m_entries.push_back(entry);
+                added = true;
+                return node;
+            }
+
+            uint32_t b = bit(entry.hash, shift);
+            if (m_dataMap & b) {
+                int i = index(m_dataMap, b);
+                const Entry& existing = m_entries[i];
+                if (existing.hash == entry.hash &&
+                        Traits::equal(existing.key, entry.key)) {
+                    node->m_entries[i].value = entry.value;
+                    return node;
+                }
+
+                // Push both entries down into a new child.
+                NodePtr child = merge(existing, entry, shift + BITS);
+                node->m_entries.erase(node->m_entries.begin() + i);
+                node->m_dataMap &= ~b;
+                node->m_nodeMap |= b;
+                node->m_nodes.insert(
+                    node->m_nodes.begin() + index(node->m_nodeMap, b), child);
+                added = true;
+                return node;
+            }
+            if (m_nodeMap & b) {
+                int i = index(m_nodeMap, b);
+                node->m_nodes[i] = m_nodes[i]->insert(entry, shift + BITS,
+                                                      added);
+                return node;
+            }
+
+            node->m_dataMap |= b;
+            node->m_entries.insert(
+                node->m_entries.begin() + index(node->m_dataMap, b), entry);
+            added = true;
+            return node;
+        }
+
+        // Returns NULL when the node ends up empty.
+        NodePtr erase(const K& key, size_t hash, unsigned shift,
+                      bool& removed) const {
+            if (shift >= HASH_BITS) {
+                for (size_t i = 0; i < m_entries.size(); i++) {
+                    if (Traits::equal(m_entries[i].key, key)) {
+                        removed = true;
+                        return without(i, 0);
+                    }
+                }
+                return this;
+            }
+
+            uint32_t b = bit(hash, shift);
+            if (m_dataMap & b) {
+                int i = index(m_dataMap, b);
+                const Entry& entry = m_entries[i];
+                if (entry.hash != hash || !Traits::equal(entry.key, key)) {
+                    return this;
+                }
+                removed = true;
+                return without(i, b);
+            }
+            if (m_nodeMap & b) {
+                int i = index(m_nodeMap, b);
+                NodePtr child = m_nodes[i]->erase(key, hash, shift + BITS,
+                                                  removed);
+                if (!removed) {
+                    return this;
+                }
+
+                Node* node = new Node(*this);
+                if (child && !child->isSingleEntry()) {
+                    node->m_nodes[i] = child;
+                    return node;
+                }
+
+                // Pull a child's last entry up into this node.
+                node->m_nodes.erase(node->m_nodes.begin() + i);
+                node->m_nodeMap &= ~b;
+                if (child) {
+                    node->m_dataMap |= b;
+                    node->m_entries.insert(node->m_entries.begin() +
+                        index(node->m_dataMap, b), child->m_entries[0]);
+                }
+                if (node->m_entries.empty() && node->m_nodes.empty()) {
+                    delete node;
+                    return NULL;
+                }
+                return node;
+            }
+            return this;
+        }
+
+        template<typename F>
+        void forEach(F& f) const {
+            for (auto& entry : m_entries) {
+                f(entry.key, entry.value);
+            }
+            for (auto& node : m_nodes) {
+                node->forEach(f);
+            }
+        }
+
+        virtual void visitRefs(Visitor& visitor) const {
+            for (auto& entry : m_entries) {
+                visitRef(visitor, entry.key);
+                visitRef(visitor, entry.value);
+            }
+            for (auto& node : m_nodes) {
+                visitRef(visitor, node);
+            }
+        }
+
+        virtual void clearRefs() {
+            m_entries.clear();
+            m_nodes.clear();
+        }
+
+    private:
+        Node(const Node& that)
+        : RefCounted()
+        , m_dataMap(that.m_dataMap)
+        , m_nodeMap(that.m_nodeMap)
+        , m_entries(that.m_entries)
+        , m_nodes(that.m_nodes)
+        { }
+
+        static uint32_t bit(size_t hash, unsigned shift) {
+            return 1u << ((hash >> shift) & ((1u << BITS) - 1));
+        }
+
+        static int index(uint32_t bitmap, uint32_t b) {
+            return __builtin_popcount(bitmap & (b - 1));
+        }
+
+        static NodePtr merge(const Entry& a, const Entry& b,
+                             unsigned shift) {
+            Node* node = new Node;
+            if (shift >= HASH_BITS) {
+                node->m_entries.push_back(a);
+                node->m_entries.push_back(b);
+                return node;
+            }
+
+            uint32_t bitA = bit(a.hash, shift);
+            uint32_t bitB = bit(b.hash, shift);
+            if (bitA == bitB) {
+                node->m_nodeMap = bitA;
+                node->m_nodes.push_back(merge(a, b, shift + BITS));
+            }
+            else {
+                node->m_dataMap = bitA | bitB;
+                node->m_entries.push_back(bitA < bitB ? a : b);
+                node->m_entries.push_back(bitA < bitB ? b : a);
+            }
+            return node;
+        }
+
+        bool isSingleEntry() const {
+            return m_entries.size() == 1 && m_nodes.empty();
+        }
+
+        NodePtr without(int i, uint32_t b) const {
+            if (isSingleEntry()) {
+                return NULL;
+            }
+            Node* node = new Node(*this);
+            node->m_entries.erase(node->m_entries.begin() + i);
+            node->m_dataMap &= ~b;
+            return node;
+        }
+
+        uint32_t m_dataMap;
+        uint32_t m_nodeMap;
+        std::vector<Entry> m_entries;
+        std::vector<NodePtr> m_nodes;
+    };
+
+    HashTrie(const NodePtr& root, size_t size)
+    : m_root(root), m_size(size) { }
+
+    NodePtr m_root;
+    size_t m_size;
+};
+
+#endif // INCLUDE_HASHTRIE_H
@@ -5,17 +5,19 @@
 #include "RefCountedPtr.h"
 #include "String.h"
 #include "Validation.h"
+#include "ValuePtr.h"
 
 #include <vector>
 
-class malValue;
-typedef RefCountedPtr<malValue>  malValuePtr;
 typedef std::vector<malValuePtr> malValueVec;
 typedef malValueVec::iterator    malValueIter;
 
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
+class malCode;
+typedef RefCountedPtr<const malCode> malCodePtr;
+
 // step*.cpp
 extern malValuePtr APPLY(malValuePtr op,
                          malValueIter argsBegin, malValueIter argsEnd);
@@ -0,0 +1,60 @@
+#include "MacroCache.h"
+#include "Environment.h"
+
+#include <unordered_map>
+
+namespace {
+    struct Expansion {
+        unsigned macro; // the serial of the macro which made it
+        malValuePtr form;
+    };
+
+    // Keyed on the call, which removes its entry as it's destroyed, so a
+    // new list at the same address never finds a stale one.
+    typedef std::unordered_map<const malList*, Expansion> Expansions;
+
+    Expansions& expansions()
+    {
+        static Expansions* expansions = new Expansions;
+        return *expansions;
+    }
+}
+
+bool MacroCache::s_enabled = false;
+MacroCache::Stats MacroCache::s_stats;
+
+malValuePtr MacroCache::expand(const malList* form, const malLambda* macro)
+{
+    // DEBUG-EVAL should show the macro's body being run every time.
+    if (!s_enabled || malEnv::mayDebugEval()) {
+        s_stats.expansions++;
+        return macro->apply(form->begin() + 1, form->end());
+    }
+
+    Expansions::iterator it = expansions().find(form);
+    if (it != expansions().end() && it->second.macro == macro->serial()) {
+        s_stats.avoided++;
+        return it->second.form;
+    }
+
+    s_stats.expansions++;
+    malValuePtr result = macro->apply(form->begin() + 1, form->end());
+
+    // Expanding may have changed the table, and replacing an old expansion
+    // may destroy lists which forget theirs, so look the entry up again,
+    // and let go of what it held only once it's been updated.
+    Expansion& entry = expansions()[form];
+    malValuePtr old = entry.form;
+    entry.macro = macro->serial();
+    entry.form = result;
+    return result;
+}
+
+void MacroCache::forget(const malList* form)
+{
+    Expansions::iterator it = expansions().find(form);
+    if (it != expansions().end()) {
+        malValuePtr old = it->second.form;
+        expansions().erase(it);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef INCLUDE_MACROCACHE_H
+#define INCLUDE_MACROCACHE_H
+
+#include "Types.h"
+
+#include <cstdint>
+
+// Remembers what each macro call expanded to, so that EVAL expands a call
+// in a loop body once rather than on every pass.
+//
+// An expansion is kept for the list which made the call, for as long as
+// that list lives, and is used again only while the call's head is the
+// same macro. Redefining the macro makes a new one, so the next call
+// expands afresh. Macros which depend on anything besides their
+// arguments, such as one which calls gensym or reads an atom, expand
+// differently from call to call, which is why the cache is off unless
+// stepA_mal is run with --cache-macros.
+class MacroCache {
+public:
+    struct Stats {
+        uint64_t expansions;
+        uint64_t avoided; // calls whose expansion was already cached
+    };
+
+    static void enable() { s_enabled = true; }
+    static bool isEnabled() { return s_enabled; }
+
+    // The expansion of form, a call to macro.
+    static malValuePtr expand(const malList* form, const malLambda* macro);
+
+    // Drops form's expansion, as form is going away.
+    static void forget(const malList* form);
+
+    static const Stats& stats() { return s_stats; }
+
+private:
+    static bool s_enabled;
+    static Stats s_stats;
+};
+
+#endif // INCLUDE_MACROCACHE_H
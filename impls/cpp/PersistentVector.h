@@ -0,0 +1,270 @@
+#ifndef INCLUDE_PERSISTENTVECTOR_H
+#define INCLUDE_PERSISTENTVECTOR_H
+
+#include "RefCountedPtr.h"
+
+#include <cstddef>
+
+// A persistent vector, as in Clojure: a trie of 32-way nodes holding all
+// but the last few items, which are kept in a tail leaf beside it. Reads
+// and updates go down one level per 5 bits of the index, so they cost
+// O(log32 n), and an update copies only the nodes on its path, sharing
+// the rest with the old vector.
+//
+// push only copies the tail, or adds it to the trie when it's full. If
+// the vector is the latest one made from its tail, the new item goes in
+// the tail's next free slot without even copying that, as the older
+// vectors sharing it never look past their own size.
+//
+// A Transient builds a vector by pushing onto nodes in place, which is
+// safe while it holds their only reference, and hands out persistent
+// vectors which share them as it goes.
+template<typename T>
+class PersistentVector {
+public:
+    PersistentVector() : m_size(0), m_shift(BITS) { }
+
+    size_t size() const { return m_size; }
+
+    const T& operator [] (size_t index) const {
+        return leafFor(index)->m_items[index & MASK];
+    }
+
+    PersistentVector push(const T& value) const {
+        size_t tailSize = m_size - tailOffset();
+        if (tailSize < WIDTH) {
+            Leaf* tail = m_tail.ptr();
+            if (tail == NULL || tail->m_count != tailSize) {
+                tail = copyLeaf(tail, tailSize);
+            }
+            tail->m_items[tailSize] = value;
+            tail->m_count++;
+            return PersistentVector(m_root, tail, m_size + 1, m_shift);
+        }
+
+        unsigned shift = m_shift;
+        BranchPtr root = pushTail(shift, m_root, m_tail, false);
+        Leaf* tail = new Leaf;
+        tail->m_items[0] = value;
+        tail->m_count = 1;
+        return PersistentVector(root, tail, m_size + 1, shift);
+    }
+
+    PersistentVector set(size_t index, const T& value) const {
+        if (index >= tailOffset()) {
+            Leaf* tail = copyLeaf(m_tail.ptr(), m_size - tailOffset());
+            tail->m_items[index & MASK] = value;
+            return PersistentVector(m_root, tail, m_size, m_shift);
+        }
+        BranchPtr root = static_cast<const Branch*>(
+            setIn(m_root.ptr(), m_shift, index, value).ptr());
+        return PersistentVector(root, m_tail, m_size, m_shift);
+    }
+
+    // Calls f(item) for each item, in order.
+    template<typename F>
+    void forEach(F f) const {
+        size_t tailStart = tailOffset();
+        for (size_t i = 0; i < tailStart; i += WIDTH) {
+            const Leaf* leaf = leafFor(i);
+            for (size_t j = 0; j < WIDTH; j++) {
+                f(leaf->m_items[j]);
+            }
+        }
+        for (size_t j = 0; j < m_size - tailStart; j++) {
+            f(m_tail->m_items[j]);
+        }
+    }
+
+    void visitRefs(RefCounted::Visitor& visitor) const {
+        visitRef(visitor, m_root);
+        visitRef(visitor, m_tail);
+    }
+
+    class Transient {
+    public:
+        void push(const T& value) {
+            size_t tailSize = m_vector.m_size - m_vector.tailOffset();
+            if (tailSize == WIDTH) {
+                m_vector.m_root = m_vector.pushTail(m_vector.m_shift,
+                    m_vector.m_root, m_vector.m_tail, true);
+                m_vector.m_tail = NULL;
+                tailSize = 0;
+            }
+            Leaf* tail = m_vector.m_tail.ptr();
+            if (tail == NULL || tail->refCount() != 1) {
+                tail = copyLeaf(tail, tailSize);
+                m_vector.m_tail = tail;
+            }
+            tail->m_items[tailSize] = value;
+            tail->m_count = tailSize + 1;
+            m_vector.m_size++;
+        }
+
+        size_t size() const { return m_vector.m_size; }
+
+        // The vector so far. Pushing more afterwards leaves it unchanged.
+        const PersistentVector& persistent() const { return m_vector; }
+
+    private:
+        PersistentVector m_vector;
+    };
+
+private:
+    static const unsigned BITS = 5;
+    static const size_t WIDTH = 1 << BITS;
+    static const size_t MASK = WIDTH - 1;
+
+    // Leaves hold items, and branches hold nodes of the level below.
+    // A leaf counts the slots which some vector has filled.
+    class Node : public RefCounted { };
+    typedef RefCountedPtr<const Node> NodePtr;
+
+    class Leaf : public Node {
+    public:
+        Leaf() : m_count(0) { }
+
+        virtual void visitRefs(RefCounted::Visitor& visitor) const {
+            for (size_t i = 0; i < m_count; i++) {
+                visitRef(visitor, m_items[i]);
+            }
+        }
+
+        virtual void clearRefs() {
+            for (size_t i = 0; i < m_count; i++) {
+                m_items[i] = T();
+            }
+        }
+
+        T m_items[WIDTH];
+        size_t m_count;
+    };
+    typedef RefCountedPtr<Leaf> LeafPtr;
+
+    class Branch : public Node {
+    public:
+        virtual void visitRefs(RefCounted::Visitor& visitor) const {
+            for (size_t i = 0; i < WIDTH; i++) {
+                visitRef(visitor, m_children[i]);
+            }
+        }
+
+        virtual void clearRefs() {
+            for (size_t i = 0; i < WIDTH; i++) {
+                m_children[i] = NULL;
+            }
+        }
+
+        NodePtr m_children[WIDTH];
+    };
+    typedef RefCountedPtr<const Branch> BranchPtr;
+
+    PersistentVector(const BranchPtr& root, const LeafPtr& tail, size_t size,
+                     unsigned shift)
+    : m_root(root), m_tail(tail), m_size(size), m_shift(shift) { }
+
+    // The index of the tail's first item.
+    size_t tailOffset() const {
+        return m_size < WIDTH ? 0 : ((m_size - 1) >> BITS) << BITS;
+    }
+
+    const Leaf* leafFor(size_t index) const {
+        if (index >= tailOffset()) {
+            return m_tail.ptr();
+        }
+        const Node* node = m_root.ptr();
+        for (unsigned level = m_shift; level > 0; level -= BITS) {
+            node = static_cast<const Branch*>(node)->m_children[
+                (index >> level) & MASK].ptr();
+        }
+        return static_cast<const Leaf*>(node);
+    }
+
+    static Leaf* copyLeaf(const Leaf* leaf, size_t count) {
+        Leaf* copy = new Leaf;
+        for (size_t i = 0; i < count; i++) {
+            copy->m_items[i] = leaf->m_items[i];
+        }
+        copy->m_count = count;
+        return copy;
+    }
+
+    static Branch* copyBranch(const Branch* branch) {
+        Branch* copy = new Branch;
+        if (branch != NULL) {
+            for (size_t i = 0; i < WIDTH; i++) {
+                copy->m_children[i] = branch->m_children[i];
+            }
+        }
+        return copy;
+    }
+
+    // A branch, or the one it's uniquely held by a transient.
+    static Branch* editable(const Branch* branch, bool inPlace) {
+        if (inPlace && branch != NULL && branch->refCount() == 1) {
+            return const_cast<Branch*>(branch);
+        }
+        return copyBranch(branch);
+    }
+
+    // The root with the full tail of a vector of the given size added to
+    // it, deepening the trie first if it's full. Updates shift to match.
+    BranchPtr pushTail(unsigned& shift, const BranchPtr& root,
+                       const LeafPtr& tail, bool inPlace) const {
+        if ((m_size >> BITS) > ((size_t)1 << shift)) {
+            Branch* newRoot = new Branch;
+            newRoot->m_children[0] = root.ptr();
+            newRoot->m_children[1] = newPath(shift, tail);
+            shift += BITS;
+            return newRoot;
+        }
+        return pushTailAt(shift, root.ptr(), tail, inPlace);
+    }
+
+    BranchPtr pushTailAt(unsigned level, const Branch* parent,
+                         const LeafPtr& tail, bool inPlace) const {
+        Branch* branch = editable(parent, inPlace);
+        size_t i = ((m_size - 1) >> level) & MASK;
+        if (level == BITS) {
+            branch->m_children[i] = tail.ptr();
+        }
+        else if (const Node* child = branch->m_children[i].ptr()) {
+            branch->m_children[i] = pushTailAt(level - BITS,
+                static_cast<const Branch*>(child), tail, inPlace).ptr();
+        }
+        else {
+            branch->m_children[i] = newPath(level - BITS, tail);
+        }
+        return branch;
+    }
+
+    static NodePtr newPath(unsigned level, const LeafPtr& leaf) {
+        if (level == 0) {
+            return leaf.ptr();
+        }
+        Branch* branch = new Branch;
+        branch->m_children[0] = newPath(level - BITS, leaf);
+        return branch;
+    }
+
+    static NodePtr setIn(const Node* node, unsigned level, size_t index,
+                         const T& value) {
+        if (level == 0) {
+            Leaf* leaf = copyLeaf(static_cast<const Leaf*>(node), WIDTH);
+            leaf->m_items[index & MASK] = value;
+            return leaf;
+        }
+        Branch* branch = copyBranch(static_cast<const Branch*>(node));
+        size_t i = (index >> level) & MASK;
+        branch->m_children[i] = setIn(branch->m_children[i].ptr(),
+                                      level - BITS, index, value);
+        return branch;
+    }
+
+    BranchPtr m_root;
+    LeafPtr m_tail;
+    size_t m_size;
+    unsigned m_shift;
+};
+
+#endif // INCLUDE_PERSISTENTVECTOR_H
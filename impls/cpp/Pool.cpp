@@ -0,0 +1,22 @@
+#include "Pool.h"
+
+Pool::Block* Pool::s_freeLists[Pool::SIZE_CLASSES];
+Pool::Stats Pool::s_stats;
+
+void Pool::refill(size_t sizeClass)
+{
+    size_t blockSize = (sizeClass + 1) * GRANULE;
+    char* chunk = static_cast<char*>(::operator new(CHUNK_SIZE));
+    s_stats.chunkBytes += CHUNK_SIZE;
+
+    // Thread the chunk's blocks onto the list in address order.
+    Block* head = NULL;
+    for (size_t offset = CHUNK_SIZE - CHUNK_SIZE % blockSize;
+            offset >= blockSize; ) {
+        offset -= blockSize;
+        Block* block = reinterpret_cast<Block*>(chunk + offset);
+        block->next = head;
+        head = block;
+    }
+    s_freeLists[sizeClass] = head;
+}
@@ -0,0 +1,74 @@
+#ifndef INCLUDE_POOL_H
+#define INCLUDE_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// The allocator behind every RefCounted object, which is to say values,
+// environments, sequence buffers and hash trie nodes.
+//
+// Sizes up to MAX_SIZE are rounded up to a multiple of GRANULE, and each
+// of those size classes keeps a free list of blocks carved out of large
+// chunks. Freed blocks go back on their list rather than to the system,
+// so after warming up, making and dropping an object is a couple of
+// pointer moves. Anything larger goes to the global operator new.
+//
+// The interpreter is single threaded, so the lists are plain statics.
+class Pool {
+public:
+    struct Stats {
+        uint64_t allocations;
+        uint64_t frees;
+        uint64_t chunkBytes;
+    };
+
+    static void* allocate(size_t size) {
+        s_stats.allocations++;
+        if (size > MAX_SIZE) {
+            return ::operator new(size);
+        }
+        Block*& head = s_freeLists[sizeClass(size)];
+        if (head == NULL) {
+            refill(sizeClass(size));
+        }
+        Block* block = head;
+        head = block->next;
+        return block;
+    }
+
+    static void release(void* p, size_t size) {
+        s_stats.frees++;
+        if (size > MAX_SIZE) {
+            ::operator delete(p);
+            return;
+        }
+        Block* block = static_cast<Block*>(p);
+        Block*& head = s_freeLists[sizeClass(size)];
+        block->next = head;
+        head = block;
+    }
+
+    static const Stats& stats() { return s_stats; }
+
+private:
+    static const size_t GRANULE = 16;
+    static const size_t MAX_SIZE = 256;
+    static const size_t SIZE_CLASSES = MAX_SIZE / GRANULE;
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    struct Block {
+        Block* next;
+    };
+
+    static size_t sizeClass(size_t size) {
+        return (size + GRANULE - 1) / GRANULE - 1;
+    }
+
+    static void refill(size_t sizeClass);
+
+    static Block* s_freeLists[SIZE_CLASSES];
+    static Stats s_stats;
+};
+
+#endif // INCLUDE_POOL_H
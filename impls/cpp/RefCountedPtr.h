@@ -2,23 +2,66 @@
 #define INCLUDE_REFCOUNTEDPTR_H
 
 #include "Debug.h"
+#include "Pool.h"
 
 #include <cstddef>
 
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
-    virtual ~RefCounted() { }
+    // Sees each counted reference an object holds, for the cycle
+    // collector.
+    class Visitor {
+    public:
+        virtual ~Visitor() { }
+        virtual void visit(const RefCounted* object) = 0;
+    };
+
+    RefCounted() : m_refCount(0), m_rootIndex(0), m_color(0), m_acyclic(0)
+    { }
+    virtual ~RefCounted() {
+        if (m_rootIndex != 0) {
+            removePossibleRoot();
+        }
+    }
 
     const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
+    int release() const {
+        int count = --m_refCount;
+        if (count != 0 && !m_acyclic && m_rootIndex == 0) {
+            addPossibleRoot();
+        }
+        return count;
+    }
     int refCount() const { return m_refCount; }
 
+    // Must report exactly the references which this object counts.
+    virtual void visitRefs(Visitor& visitor) const { }
+
+    // Drops every reference this object holds. Only the cycle collector
+    // calls this, on objects which are about to be destroyed.
+    virtual void clearRefs() { }
+
+    static void* operator new(size_t size) { return Pool::allocate(size); }
+    static void operator delete(void* p, size_t size) {
+        Pool::release(p, size);
+    }
+
+protected:
+    // For objects which hold no references, so can't be part of a cycle.
+    void setAcyclic(bool acyclic) { m_acyclic = acyclic; }
+
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
+    friend class Collector;
+    void addPossibleRoot() const;
+    void removePossibleRoot() const;
+
     mutable int m_refCount;
+    mutable unsigned m_rootIndex : 28; // 1 + index in the roots, or 0
+    mutable unsigned m_color : 2;
+    unsigned m_acyclic : 1;
 };
 
 template<class T>
@@ -74,4 +117,12 @@ private:
     T* m_object;
 };
 
+template<class T>
+void visitRef(RefCounted::Visitor& visitor, const RefCountedPtr<T>& ref)
+{
+    if (ref) {
+        visitor.visit(ref.ptr());
+    }
+}
+
 #endif // INCLUDE_REFCOUNTEDPTR_H
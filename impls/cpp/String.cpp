@@ -1,6 +1,8 @@
 #include "Debug.h"
 #include "String.h"
 
+#include "../cpp-common/escape.h"
+
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,51 +40,17 @@ String copyAndFree(char* mallocedString)
 String escape(const String& in)
 {
     String out;
-    out.reserve(in.size() * 2 + 2); // each char may get escaped + two "'s
+    out.reserve(in.size() + 2);
     out += '"';
-    for (auto it = in.begin(), end = in.end(); it != end; ++it) {
-        char c = *it;
-        switch (c) {
-            case '\\': out += "\\\\"; break;
-            case '\n': out += "\\n"; break;
-            case '"':  out += "\\\""; break;
-            default:   out += c;      break;
-        };
-    }
+    mal_escape::escape(out, in.data(), in.size());
     out += '"';
-    out.shrink_to_fit();
     return out;
 }
 
-static char unescape(char c)
-{
-    switch (c) {
-        case '\\':  return '\\';
-        case 'n':   return '\n';
-        case '"':   return '"';
-        default:    return c;
-    }
-}
-
 String unescape(const String& in)
 {
+    // in will have double-quotes at either end, so skip them
     String out;
-    out.reserve(in.size()); // unescaped string will always be shorter
-
-    // in will have double-quotes at either end, so move the iterators in
-    for (auto it = in.begin()+1, end = in.end()-1; it != end; ++it) {
-        char c = *it;
-        if (c == '\\') {
-            ++it;
-            if (it != end) {
-                out += unescape(*it);
-            }
-        }
-        else {
-            out += c;
-        }
-    }
-    out.shrink_to_fit();
+    mal_escape::unescape(out, in.data() + 1, in.size() - 2);
     return out;
 }
-
@@ -1,10 +1,12 @@
+#include "Collector.h"
 #include "Debug.h"
 #include "Environment.h"
+#include "MacroCache.h"
 #include "Types.h"
 
 #include <algorithm>
+#include <iostream>
 #include <memory>
-#include <typeinfo>
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
@@ -20,8 +22,7 @@ namespace mal {
     };
 
     malValuePtr falseValue() {
-        static malValuePtr c(new malConstant("false"));
-        return malValuePtr(c);
+        return malValuePtr::constant(malValuePtr::FALSE);
     };
 
 
@@ -35,6 +36,9 @@ namespace mal {
     }
 
     malValuePtr integer(int64_t value) {
+        if (malValuePtr::fitsFixnum(value)) {
+            return malValuePtr::fixnum(value);
+        }
         return malValuePtr(new malInteger(value));
     };
 
@@ -51,6 +55,11 @@ namespace mal {
         return malValuePtr(new malLambda(bindings, body, env));
     }
 
+    malValuePtr lambda(const malEnv::Params& params,
+                       malValuePtr body, malEnvPtr env, malCodePtr code) {
+        return malValuePtr(new malLambda(params, body, env, code));
+    }
+
     malValuePtr list(malValueVec* items) {
         return malValuePtr(new malList(items));
     };
@@ -85,8 +94,7 @@ namespace mal {
     };
 
     malValuePtr nilValue() {
-        static malValuePtr c(new malConstant("nil"));
-        return malValuePtr(c);
+        return malValuePtr::constant(malValuePtr::NIL);
     };
 
     malValuePtr string(const String& token) {
@@ -98,43 +106,127 @@ namespace mal {
     };
 
     malValuePtr trueValue() {
-        static malValuePtr c(new malConstant("true"));
-        return malValuePtr(c);
+        return malValuePtr::constant(malValuePtr::TRUE);
     };
 
     malValuePtr vector(malValueVec* items) {
-        return malValuePtr(new malVector(items));
+        if ((int)items->size() <= malVector::MAX_FLAT) {
+            return malValuePtr(new malVector(items));
+        }
+        std::unique_ptr<malValueVec> owner(items);
+        return vector(items->begin(), items->end());
     };
 
     malValuePtr vector(malValueIter begin, malValueIter end) {
-        return malValuePtr(new malVector(begin, end));
+        if (std::distance(begin, end) <= malVector::MAX_FLAT) {
+            return malValuePtr(new malVector(new malValueVec(begin, end)));
+        }
+        malVector::Transient items;
+        for (auto it = begin; it != end; ++it) {
+            items.push(*it);
+        }
+        return malValuePtr(new malTrieVector(items.persistent()));
     };
+
+    malValuePtr vector(const malVector::Items& items) {
+        if ((int)items.size() <= malVector::MAX_FLAT) {
+            malValueVec* flat = new malValueVec;
+            flat->reserve(items.size());
+            items.forEach([flat](const malValuePtr& item) {
+                flat->push_back(item);
+            });
+            return malValuePtr(new malVector(flat));
+        }
+        return malValuePtr(new malTrieVector(items));
+    };
+};
+
+// Indexed by the constant's value / 2. These are never freed, so they
+// need no reference counts.
+malValue* const malValuePtr::s_constants[] = {
+    NULL,
+    new malConstant("nil"),
+    new malConstant("true"),
+    new malConstant("false"),
 };
 
+malValue* malValuePtr::box() const
+{
+    malValue* object = new malInteger(fixnumValue());
+    object->acquire();
+    m_bits = reinterpret_cast<uintptr_t>(object);
+    return object;
+}
+
+// Each buffer is reserved once and never grows past its capacity, so
+// the iterators of the frames in it stay valid while later frames are
+// added above them.
+static const size_t ARG_BUFFER_SIZE = 1024;
+static std::vector<std::unique_ptr<malValueVec>> s_argBuffers;
+static size_t s_argTop = 0;
+
+malArgs::malArgs(int count)
+: m_count(count)
+, m_prevTop(s_argTop)
+{
+    if (s_argBuffers.empty()) {
+        s_argBuffers.emplace_back(new malValueVec);
+        s_argBuffers[0]->reserve(ARG_BUFFER_SIZE);
+    }
+
+    m_buffer = s_argBuffers[s_argTop].get();
+    if (m_buffer->capacity() - m_buffer->size() < (size_t)count) {
+        // Buffers above the top are empty, so we can grow them freely.
+        if (++s_argTop == s_argBuffers.size()) {
+            s_argBuffers.emplace_back(new malValueVec);
+        }
+        m_buffer = s_argBuffers[s_argTop].get();
+        m_buffer->reserve(std::max(ARG_BUFFER_SIZE, (size_t)count));
+    }
+
+    size_t start = m_buffer->size();
+    m_buffer->resize(start + count);
+    m_begin = m_buffer->begin() + start;
+}
+
+malArgs::~malArgs()
+{
+    m_buffer->erase(m_begin, m_buffer->end());
+    s_argTop = m_prevTop;
+}
+
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
+static const malValuePtr& checkHashKey(const malValuePtr& key)
 {
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
-    }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
-    }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
+    MAL_CHECK(value_is<malString>(key) || value_is<malKeyword>(key),
+              "%s is not a string or keyword", key->print(true).c_str());
+    return key;
+}
+
+size_t malHash::KeyTraits::hash(const malValuePtr& key)
+{
+    return STATIC_CAST(malStringBase, key)->hash();
+}
+
+bool malHash::KeyTraits::equal(const malValuePtr& lhs, const malValuePtr& rhs)
+{
+    const malStringBase* l = STATIC_CAST(malStringBase, lhs);
+    const malStringBase* r = STATIC_CAST(malStringBase, rhs);
+    return l->type() == r->type() && l->value() == r->value();
 }
 
-static malHash::Map addToMap(malHash::Map& map,
+static malHash::Map addToMap(malHash::Map map,
     malValueIter argsBegin, malValueIter argsEnd)
 {
     // This is intended to be called with pre-evaluated arguments.
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
+        const malValuePtr& key = checkHashKey(*it++);
+        map = map.insert(key, *it);
     }
 
     return map;
@@ -145,19 +237,20 @@ static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "hash-map requires an even-sized list");
 
-    malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
+    return addToMap(malHash::Map(), argsBegin, argsEnd);
 }
 
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
-: m_map(createMap(argsBegin, argsEnd))
+: malValue(HASH)
+, m_map(createMap(argsBegin, argsEnd))
 , m_isEvaluated(isEvaluated)
 {
 
 }
 
 malHash::malHash(const malHash::Map& map)
-: m_map(map)
+: malValue(HASH)
+, m_map(map)
 , m_isEvaluated(true)
 {
 
@@ -169,14 +262,12 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "assoc requires an even-sized list");
 
-    malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
+    return mal::hash(addToMap(m_map, argsBegin, argsEnd));
 }
 
 bool malHash::contains(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    return m_map.find(checkHashKey(key)) != NULL;
 }
 
 malValuePtr
@@ -184,8 +275,7 @@ malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
     malHash::Map map(m_map);
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+        map = map.erase(checkHashKey(*it));
     }
     return mal::hash(map);
 }
@@ -197,57 +287,46 @@ malValuePtr malHash::eval(malEnvPtr env)
     }
 
     malHash::Map map;
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
-    }
+    m_map.forEach([&](const malValuePtr& key, const malValuePtr& value) {
+        map = map.insert(key, EVAL(value, env));
+    });
     return mal::hash(map);
 }
 
 malValuePtr malHash::get(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    const malValuePtr* value = m_map.find(checkHashKey(key));
+    return value ? *value : mal::nilValue();
 }
 
 malValuePtr malHash::keys() const
 {
     malValueVec* keys = new malValueVec();
     keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
-    }
+    m_map.forEach([=](const malValuePtr& key, const malValuePtr&) {
+        keys->push_back(key);
+    });
     return mal::list(keys);
 }
 
 malValuePtr malHash::values() const
 {
-    malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
-    }
-    return mal::list(keys);
+    malValueVec* values = new malValueVec();
+    values->reserve(m_map.size());
+    m_map.forEach([=](const malValuePtr&, const malValuePtr& value) {
+        values->push_back(value);
+    });
+    return mal::list(values);
 }
 
 String malHash::print(bool readably) const
 {
-    String s = "{";
-
-    auto it = m_map.begin(), end = m_map.end();
-    if (it != end) {
-        s += it->first + " " + it->second->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
-    }
-
-    return s + "}";
+    String s;
+    m_map.forEach([&](const malValuePtr& key, const malValuePtr& value) {
+        s += s.empty() ? "{" : " ";
+        s += key->print(true) + " " + value->print(readably);
+    });
+    return s.empty() ? "{}" : s + "}";
 }
 
 bool malHash::doIsEqualTo(const malValue* rhs) const
@@ -257,53 +336,103 @@ bool malHash::doIsEqualTo(const malValue* rhs) const
         return false;
     }
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
+    bool equal = true;
+    m_map.forEach([&](const malValuePtr& key, const malValuePtr& value) {
+        const malValuePtr* r_value = r_map.find(key);
+        equal = equal && r_value && value->isEqualTo(r_value->ptr());
+    });
+    return equal;
+}
 
-        if (it0->first != it1->first) {
-            return false;
-        }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
-            return false;
-        }
-    }
-    return true;
+void malHash::visitRefs(Visitor& visitor) const
+{
+    malValue::visitRefs(visitor);
+    m_map.visitRefs(visitor);
+}
+
+void malHash::clearRefs()
+{
+    malValue::clearRefs();
+    m_map = Map();
 }
 
+unsigned malLambda::s_serials = 0;
+
 malLambda::malLambda(const StringVec& bindings,
                      malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
+: malApplicable(LAMBDA)
+, m_params(bindings)
 , m_body(body)
 , m_env(env)
 , m_isMacro(false)
+, m_serial(++s_serials)
+{
+
+}
+
+malLambda::malLambda(const malEnv::Params& params,
+                     malValuePtr body, malEnvPtr env, malCodePtr code)
+: malApplicable(LAMBDA)
+, m_params(params)
+, m_body(body)
+, m_env(env)
+, m_code(code)
+, m_isMacro(false)
+, m_serial(++s_serials)
 {
 
 }
 
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
-: malApplicable(meta)
-, m_bindings(that.m_bindings)
+: malApplicable(LAMBDA, meta)
+, m_params(that.m_params)
 , m_body(that.m_body)
 , m_env(that.m_env)
+, m_code(that.m_code)
 , m_isMacro(that.m_isMacro)
+, m_serial(++s_serials)
 {
 
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
-, m_bindings(that.m_bindings)
+: malApplicable(LAMBDA, that.m_meta)
+, m_params(that.m_params)
 , m_body(that.m_body)
 , m_env(that.m_env)
+, m_code(that.m_code)
 , m_isMacro(isMacro)
+, m_serial(++s_serials)
 {
 
 }
 
+malValuePtr malCode::run(malEnvPtr env) const
+{
+    const malCode* code = this;
+    malCodePtr current;
+    while (1) {
+        Collector::collectIfNeeded();
+
+        if (env->debugEval()) {
+            std::cout << "EVAL: " << code->source()->print(true) << "\n";
+        }
+
+        malCodePtr next;
+        malValuePtr value = code->step(env, next);
+        if (!next) {
+            return value;
+        }
+        current = next; // keeps the code alive while it runs
+        code = current.ptr();
+    }
+}
+
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
-    return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+    malEnvPtr env = makeEnv(argsBegin, argsEnd);
+    return m_code ? m_code->eval(env) : EVAL(m_body, env);
 }
 
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
@@ -311,22 +440,40 @@ malValuePtr malLambda::doWithMeta(malValuePtr meta) const
     return new malLambda(*this, meta);
 }
 
+void malLambda::visitRefs(Visitor& visitor) const
+{
+    malValue::visitRefs(visitor);
+    visitRef(visitor, m_body);
+    visitRef(visitor, m_env);
+    visitRef(visitor, m_code);
+}
+
+void malLambda::clearRefs()
+{
+    malValue::clearRefs();
+    m_body = NULL;
+    m_env = NULL;
+    m_code = NULL;
+}
+
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
+    return malEnvPtr(new malEnv(m_env, m_params, argsBegin, argsEnd));
+}
+
+malList::~malList()
+{
+    if (MacroCache::isEnabled()) {
+        MacroCache::forget(this);
+    }
 }
 
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
-
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::reverse_copy(argsBegin, argsEnd, items->begin());
-    std::copy(begin(), end(), items->begin() + newItemCount);
-
-    return mal::list(items);
+    malList* list = withFront(std::distance(argsBegin, argsEnd));
+    std::reverse_copy(argsBegin, argsEnd, list->begin());
+    return list;
 }
 
 malValuePtr malList::eval(malEnvPtr env)
@@ -357,9 +504,8 @@ malValuePtr malValue::eval(malEnvPtr env)
 bool malValue::isEqualTo(const malValue* rhs) const
 {
     // Special-case. Vectors and Lists can be compared.
-    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
-        (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+    bool matchingTypes = (type() == rhs->type()) ||
+        (malSequence::hasType(type()) && malSequence::hasType(rhs->type()));
 
     return matchingTypes && doIsEqualTo(rhs);
 }
@@ -375,33 +521,144 @@ malValuePtr malValue::meta() const
     return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
 }
 
+void malValue::visitRefs(Visitor& visitor) const
+{
+    visitRef(visitor, m_meta);
+}
+
+void malValue::clearRefs()
+{
+    m_meta = NULL;
+}
+
 malValuePtr malValue::withMeta(malValuePtr meta) const
 {
     return doWithMeta(meta);
 }
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+malSequenceBuffer::malSequenceBuffer(malValueVec* items)
+: m_first(0)
+, m_last(items->size())
+{
+    m_items.swap(*items);
+    delete items;
+}
+
+malSequenceBuffer::malSequenceBuffer(int capacity, int first, int last)
+: m_items(capacity)
+, m_first(first)
+, m_last(last)
+{
+
+}
+
+void malSequenceBuffer::visitRefs(Visitor& visitor) const
 {
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        visitRef(visitor, *it);
+    }
+}
 
+void malSequenceBuffer::clearRefs()
+{
+    std::fill(m_items.begin(), m_items.end(), malValuePtr());
+}
+
+void malSequence::visitRefs(Visitor& visitor) const
+{
+    malValue::visitRefs(visitor);
+    visitRef(visitor, m_buffer);
+}
+
+void malSequence::clearRefs()
+{
+    malValue::clearRefs();
+    m_buffer = NULL;
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+malSequence::malSequence(Type type, malValueVec* items)
+: malValue(type)
+, m_buffer(new malSequenceBuffer(items))
+, m_offset(0)
+, m_count(m_buffer->m_last)
+{
+
+}
+
+malSequence::malSequence(Type type, malValueIter begin, malValueIter end)
+: malValue(type)
+, m_buffer(new malSequenceBuffer(new malValueVec(begin, end)))
+, m_offset(0)
+, m_count(m_buffer->m_last)
+{
+
+}
+
+malSequence::malSequence(Type type, const malSequenceBufferPtr& buffer,
+                         int offset, int count)
+: malValue(type)
+, m_buffer(buffer)
+, m_offset(offset)
+, m_count(count)
+{
+
+}
+
+malSequence::malSequence(Type type, int count)
+: malValue(type)
+, m_offset(0)
+, m_count(count)
 {
 
 }
 
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+: malValue(that.type(), meta)
+, m_buffer(that.m_buffer)
+, m_offset(that.m_offset)
+, m_count(that.m_count)
+{
+
+}
+
+// Copies grow the buffer by half as much again as is needed, so that a
+// run of conses or conjs onto the latest sequence copies O(n) items in
+// total.
+static int spareCapacity(int count)
 {
+    return std::max(count / 2, 4);
+}
+
+malList* malSequence::withFront(int count) const
+{
+    malSequenceBuffer* buffer = m_buffer.ptr();
+    if (buffer && m_offset == buffer->m_first && m_offset >= count) {
+        buffer->m_first -= count;
+        return new malList(m_buffer, m_offset - count, m_count + count);
+    }
+
+    int total = m_count + count;
+    int spare = spareCapacity(total);
+    malList* list = new malList(
+        new malSequenceBuffer(spare + total, spare, spare + total),
+        spare, total);
+    copyItems(list->begin() + count);
+    return list;
+}
 
+malValueIter malSequence::copyItems(malValueIter out) const
+{
+    if (m_buffer) {
+        return std::copy(begin(), end(), out);
+    }
+    const malVector* vector = static_cast<const malVector*>(this);
+    vector->items().forEach([&out](const malValuePtr& item) { *out++ = item; });
+    return out;
 }
 
-malSequence::~malSequence()
+malValuePtr malSequence::vectorItem(int index) const
 {
-    delete m_items;
+    return static_cast<const malVector*>(this)->items()[index];
 }
 
 bool malSequence::doIsEqualTo(const malValue* rhs) const
@@ -411,11 +668,8 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
         return false;
     }
 
-    for (malValueIter it0 = m_items->begin(),
-                      it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
-
-        if (! (*it0)->isEqualTo((*it1).ptr())) {
+    for (int i = 0, end = count(); i < end; i++) {
+        if (!item(i)->isEqualTo(rhsSeq->item(i).ptr())) {
             return false;
         }
     }
@@ -424,14 +678,26 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
 
 malValueVec* malSequence::evalItems(malEnvPtr env) const
 {
-    malValueVec* items = new malValueVec;;
-    items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
-        items->push_back(EVAL(*it, env));
+    malValueVec* items = new malValueVec(count());
+    copyItems(items->begin());
+    for (auto it = items->begin(), end = items->end(); it != end; ++it) {
+        *it = EVAL(*it, env);
     }
     return items;
 }
 
+void malSequence::evalItems(malEnvPtr env, malArgs& args, int first) const
+{
+    // Unless DEBUG-EVAL wants to see them, symbols needn't go through EVAL.
+    bool mayDebugEval = malEnv::mayDebugEval();
+    for (int i = first, end = count(); i < end; i++) {
+        malValuePtr ast = item(i);
+        const malSymbol* symbol = DYNAMIC_CAST(malSymbol, ast);
+        args[i - first] = symbol && !mayDebugEval ? symbol->lookup(env)
+                                                  : EVAL(ast, env);
+    }
+}
+
 malValuePtr malSequence::first() const
 {
     return count() == 0 ? mal::nilValue() : item(0);
@@ -440,23 +706,25 @@ malValuePtr malSequence::first() const
 String malSequence::print(bool readably) const
 {
     String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
-    if (it != end) {
-        str += (*it)->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        str += " ";
-        str += (*it)->print(readably);
+    for (int i = 0, end = count(); i < end; i++) {
+        if (i > 0) {
+            str += " ";
+        }
+        str += item(i)->print(readably);
     }
     return str;
 }
 
 malValuePtr malSequence::rest() const
 {
-    malValueIter start = (count() > 0) ? begin() + 1 : end();
-    return mal::list(start, end());
+    int offset = (count() > 0) ? 1 : 0;
+    if (m_buffer) {
+        return new malList(m_buffer, m_offset + offset, m_count - offset);
+    }
+    // A vector's trie can't be shared by a list, so the list gets a copy.
+    malSequenceBuffer* buffer = new malSequenceBuffer(m_count, 0, m_count);
+    copyItems(buffer->m_items.begin());
+    return new malList(buffer, offset, m_count - offset);
 }
 
 String malString::escapedValue() const
@@ -469,27 +737,110 @@ String malString::print(bool readably) const
     return readably ? escapedValue() : value();
 }
 
+malSymbol::SpecialForm malSymbol::lookupSpecialForm(const String& token)
+{
+    struct Entry {
+        const char* name;
+        SpecialForm form;
+    };
+    static const Entry specialForms[] = {
+        { "def!",       DEF },
+        { "defmacro!",  DEFMACRO },
+        { "do",         DO },
+        { "fn*",        FN },
+        { "if",         IF },
+        { "let*",       LET },
+        { "quasiquote", QUASIQUOTE },
+        { "quote",      QUOTE },
+        { "try*",       TRY },
+    };
+
+    for (auto &entry : specialForms) {
+        if (token == entry.name) {
+            return entry.form;
+        }
+    }
+    return NONE;
+}
+
 malValuePtr malSymbol::eval(malEnvPtr env)
 {
-    return env->get(value());
+    return lookup(env);
+}
+
+malValuePtr malVector::assoc(malValueIter argsBegin,
+                             malValueIter argsEnd) const
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    if (isFlat()) {
+        std::unique_ptr<malValueVec> items(new malValueVec(begin(), end()));
+        while (argsBegin != argsEnd) {
+            int64_t i = integer_value(*argsBegin++);
+            malValuePtr value = *argsBegin++;
+            MAL_CHECK(i >= 0 && i <= (int64_t)items->size(),
+                      "Index out of range");
+            if (i == (int64_t)items->size()) {
+                items->push_back(value);
+            }
+            else {
+                (*items)[i] = value;
+            }
+        }
+        return mal::vector(items.release());
+    }
+
+    Items items = this->items();
+    while (argsBegin != argsEnd) {
+        int64_t i = integer_value(*argsBegin++);
+        malValuePtr value = *argsBegin++;
+        MAL_CHECK(i >= 0 && i <= (int64_t)items.size(), "Index out of range");
+        items = (i == (int64_t)items.size()) ? items.push(value)
+                                             : items.set(i, value);
+    }
+    return mal::vector(items);
 }
 
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
-
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
-    std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
+    if (isFlat()) {
+        malValueVec* items = new malValueVec(begin(), end());
+        items->insert(items->end(), argsBegin, argsEnd);
+        return mal::vector(items);
+    }
 
+    Items items = this->items();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items = items.push(*it);
+    }
     return mal::vector(items);
 }
 
 malValuePtr malVector::eval(malEnvPtr env)
 {
-    return mal::vector(evalItems(env));
+    if (isFlat()) {
+        return mal::vector(evalItems(env));
+    }
+
+    Transient evaluated;
+    items().forEach([&evaluated, &env](const malValuePtr& item) {
+        evaluated.push(EVAL(item, env));
+    });
+    return mal::vector(evaluated.persistent());
+}
+
+void malTrieVector::visitRefs(Visitor& visitor) const
+{
+    malVector::visitRefs(visitor);
+    m_items.visitRefs(visitor);
+}
+
+void malTrieVector::clearRefs()
+{
+    malVector::clearRefs();
+    m_items = Items();
 }
 
 String malVector::print(bool readably) const
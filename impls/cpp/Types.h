@@ -2,19 +2,40 @@
 #define INCLUDE_TYPES_H
 
 #include "MAL.h"
+#include "Environment.h"
+#include "HashTrie.h"
+#include "PersistentVector.h"
 
 #include <exception>
-#include <map>
+#include <functional>
 
 class malEmptyInputException : public std::exception { };
 
 class malValue : public RefCounted {
 public:
-    malValue() {
+    // The concrete type of a value. Families of types are kept together,
+    // so that checking for one is a range check.
+    enum Type {
+        CONSTANT,
+        INTEGER,
+        STRING,
+        KEYWORD,
+        SYMBOL,
+        LIST,           // sequences
+        VECTOR,
+        HASH,
+        BUILTIN,        // applicables
+        LAMBDA,
+        ATOM,
+    };
+
+    malValue(Type type) : m_type(type) {
         TRACE_OBJECT("Creating malValue %p\n", this);
+        setAcyclic(isLeaf(type));
     }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue(Type type, malValuePtr meta) : m_type(type), m_meta(meta) {
         TRACE_OBJECT("Creating malValue %p\n", this);
+        setAcyclic(isLeaf(type) && meta.isImmediate());
     }
     virtual ~malValue() {
         TRACE_OBJECT("Destroying malValue %p\n", this);
@@ -32,22 +53,99 @@ public:
 
     virtual String print(bool readably) const = 0;
 
+    Type type() const { return m_type; }
+    static bool hasType(Type type) { return true; }
+
+    virtual void visitRefs(Visitor& visitor) const;
+    virtual void clearRefs();
+
 protected:
+    // Whether values of the type hold no references, apart from meta.
+    static bool isLeaf(Type type) {
+        return type <= SYMBOL || type == BUILTIN;
+    }
+
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
+    const Type m_type;
     malValuePtr m_meta;
 };
 
+inline malValuePtr::malValuePtr(malValue* object)
+: m_bits(reinterpret_cast<uintptr_t>(object))
+{
+    for (int c = NIL; c <= FALSE; c += 2) {
+        if (object == s_constants[c >> 1]) {
+            m_bits = c;
+            return;
+        }
+    }
+    acquire();
+}
+
+inline malValue* malValuePtr::ptr() const {
+    if (isFixnum()) {
+        return box();
+    }
+    if (m_bits <= FALSE) {
+        return s_constants[m_bits >> 1];
+    }
+    return reinterpret_cast<malValue*>(m_bits);
+}
+
+inline void malValuePtr::acquire() const {
+    if (!isImmediate()) {
+        reinterpret_cast<malValue*>(m_bits)->acquire();
+    }
+}
+
+inline void malValuePtr::release() const {
+    if (!isImmediate()) {
+        malValue* object = reinterpret_cast<malValue*>(m_bits);
+        if (object->release() == 0) {
+            delete object;
+        }
+    }
+}
+
+inline void visitRef(RefCounted::Visitor& visitor, const malValuePtr& ref)
+{
+    if (!ref.isImmediate()) {
+        visitor.visit(ref.ptr());
+    }
+}
+
+// Whether obj is a T, checked on the type tag. Every class has a static
+// hasType() which says which tags belong to it. Inline values are
+// checked without looking at an object, so fixnums aren't boxed.
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
-    T* dest = dynamic_cast<T*>(obj.ptr());
+bool value_is(const malValuePtr& obj) {
+    if (obj.isFixnum()) {
+        return T::hasType(malValue::INTEGER);
+    }
+    if (obj.isImmediate()) {
+        return obj && T::hasType(malValue::CONSTANT);
+    }
+    return T::hasType(obj->type());
+}
+
+// Fixnums are only boxed when the cast is to malInteger or one of its
+// bases.
+template<class T>
+T* dynamic_value_cast(const malValuePtr& obj) {
+    return value_is<T>(obj) ? static_cast<T*>(obj.ptr()) : NULL;
+}
+
+template<class T>
+T* value_cast(const malValuePtr& obj, const char* typeName) {
+    T* dest = dynamic_value_cast<T>(obj);
     MAL_CHECK(dest != NULL, "%s is not a %s",
               obj->print(true).c_str(), typeName);
     return dest;
 }
 
 #define VALUE_CAST(Type, Value)    value_cast<Type>(Value, #Type)
-#define DYNAMIC_CAST(Type, Value)  (dynamic_cast<Type*>((Value).ptr()))
+#define DYNAMIC_CAST(Type, Value)  dynamic_value_cast<Type>(Value)
 #define STATIC_CAST(Type, Value)   (static_cast<Type*>((Value).ptr()))
 
 #define WITH_META(Type) \
@@ -57,9 +155,11 @@ T* value_cast(malValuePtr obj, const char* typeName) {
 
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
+    malConstant(String name) : malValue(CONSTANT), m_name(name) { }
     malConstant(const malConstant& that, malValuePtr meta)
-        : malValue(meta), m_name(that.m_name) { }
+        : malValue(CONSTANT, meta), m_name(that.m_name) { }
+
+    static bool hasType(Type type) { return type == CONSTANT; }
 
     virtual String print(bool readably) const { return m_name; }
 
@@ -75,9 +175,11 @@ private:
 
 class malInteger : public malValue {
 public:
-    malInteger(int64_t value) : m_value(value) { }
+    malInteger(int64_t value) : malValue(INTEGER), m_value(value) { }
     malInteger(const malInteger& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(INTEGER, meta), m_value(that.m_value) { }
+
+    static bool hasType(Type type) { return type == INTEGER; }
 
     virtual String print(bool readably) const {
         return std::to_string(m_value);
@@ -95,28 +197,53 @@ private:
     const int64_t m_value;
 };
 
+// The value of an integer, without boxing it if it is a fixnum.
+inline int64_t integer_value(const malValuePtr& obj) {
+    if (obj.isFixnum()) {
+        return obj.fixnumValue();
+    }
+    return VALUE_CAST(malInteger, obj)->value();
+}
+
 class malStringBase : public malValue {
 public:
-    malStringBase(const String& token)
-        : m_value(token) { }
+    malStringBase(Type type, const String& token)
+        : malValue(type), m_value(token), m_hash(0) { }
     malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+        : malValue(that.type(), meta), m_value(that.value())
+        , m_hash(that.m_hash) { }
+
+    static bool hasType(Type type) {
+        return type >= STRING && type <= SYMBOL;
+    }
 
     virtual String print(bool readably) const { return m_value; }
 
-    String value() const { return m_value; }
+    const String& value() const { return m_value; }
+
+    // Hash of the type and value, worked out on first use.
+    size_t hash() const {
+        if (m_hash == 0) {
+            m_hash = std::hash<String>()(m_value) ^ (type() * 0x9e3779b9);
+            m_hash += (m_hash == 0);
+        }
+        return m_hash;
+    }
 
 private:
     const String m_value;
+    mutable size_t m_hash;
 };
 
 class malString : public malStringBase {
 public:
     malString(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(STRING, token) { }
     malString(const malString& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
+    static bool hasType(Type type) { return type == STRING; }
+
     virtual String print(bool readably) const;
 
     String escapedValue() const;
@@ -131,10 +258,12 @@ public:
 class malKeyword : public malStringBase {
 public:
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(KEYWORD, token) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
+    static bool hasType(Type type) { return type == KEYWORD; }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malKeyword*>(rhs)->value();
     }
@@ -144,10 +273,32 @@ public:
 
 class malSymbol : public malStringBase {
 public:
+    // The special form a symbol names, looked up once when the symbol is
+    // made, so that EVAL can tell a special form from a call without
+    // comparing strings.
+    enum SpecialForm {
+        NONE,
+        DEF,
+        DEFMACRO,
+        DO,
+        FN,
+        IF,
+        LET,
+        QUASIQUOTE,
+        QUOTE,
+        TRY,
+    };
+
     malSymbol(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(SYMBOL, token)
+        , m_special(lookupSpecialForm(token))
+        , m_name(token) { }
     malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta)
+        , m_special(that.m_special)
+        , m_name(that.m_name) { }
+
+    static bool hasType(Type type) { return type == SYMBOL; }
 
     virtual malValuePtr eval(malEnvPtr env);
 
@@ -155,25 +306,101 @@ public:
         return value() == static_cast<const malSymbol*>(rhs)->value();
     }
 
+    SpecialForm specialForm() const { return m_special; }
+    const malEnv::Name& name() const { return m_name; }
+
+    // The symbol's value in env, found through the cache of where this
+    // symbol last found it.
+    malValuePtr lookup(const malEnvPtr& env) const {
+        return env->get(m_name.id(), m_cache);
+    }
+
     WITH_META(malSymbol);
+
+private:
+    static SpecialForm lookupSpecialForm(const String& token);
+
+    const SpecialForm m_special;
+    const malEnv::Name m_name;
+    mutable malEnv::GlobalCache m_cache;
 };
 
+// The arguments of one call, held in a stack of buffers that are reused
+// from call to call, so that passing arguments doesn't allocate once the
+// stack has grown to the deepest call. Frames must be destroyed in the
+// reverse order of their creation, which holds as long as they live on
+// the C++ stack.
+class malArgs {
+public:
+    malArgs(int count);
+    ~malArgs();
+
+    malValuePtr& operator [] (int index) const { return m_begin[index]; }
+    malValueIter begin() const { return m_begin; }
+    malValueIter end()   const { return m_begin + m_count; }
+
+private:
+    malArgs(const malArgs&); // no copy ctor
+    malArgs& operator = (const malArgs&); // no assignments
+
+    const int m_count;
+    const size_t m_prevTop;
+    malValueVec* m_buffer;
+    malValueIter m_begin;
+};
+
+// The storage behind malSequence, shared between sequences which each
+// see a range of it. Only the slots in [m_first, m_last) are in use, so a
+// sequence whose range starts at m_first can have items put in front of
+// it in place, and one whose range ends at m_last can have items put
+// after it, without any other sequence seeing them. The vector is never
+// resized, which would move the items under everyone's iterators.
+class malSequenceBuffer : public RefCounted {
+public:
+    malSequenceBuffer(malValueVec* items);
+    malSequenceBuffer(int capacity, int first, int last);
+
+    virtual void visitRefs(Visitor& visitor) const;
+    virtual void clearRefs();
+
+    malValueVec m_items;
+    int m_first;
+    int m_last;
+};
+
+typedef RefCountedPtr<malSequenceBuffer> malSequenceBufferPtr;
+
+class malList;
+class malVector;
+
 class malSequence : public malValue {
 public:
-    malSequence(malValueVec* items);
-    malSequence(malValueIter begin, malValueIter end);
+    malSequence(Type type, malValueVec* items);
+    malSequence(Type type, malValueIter begin, malValueIter end);
+    malSequence(Type type, const malSequenceBufferPtr& buffer,
+                int offset, int count);
     malSequence(const malSequence& that, malValuePtr meta);
-    virtual ~malSequence();
+
+    // For vectors too long to be flat, whose items live in a trie.
+    malSequence(Type type, int count);
+
+    static bool hasType(Type type) {
+        return type >= LIST && type <= VECTOR;
+    }
 
     virtual String print(bool readably) const;
 
     malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    void evalItems(malEnvPtr env, malArgs& args, int first = 0) const;
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    malValuePtr item(int index) const {
+        return m_buffer ? m_buffer->m_items[m_offset + index]
+                        : vectorItem(index);
+    }
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    // Copies the items to out, and returns the end of the copy.
+    malValueIter copyItems(malValueIter out) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
@@ -183,17 +410,42 @@ public:
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+    // A list of count new items followed by this sequence's items, which
+    // it shares where it can. The new items are NULL for the caller to
+    // fill in before the list is used.
+    malList* withFront(int count) const;
+
+    virtual void visitRefs(Visitor& visitor) const;
+    virtual void clearRefs();
+
+protected:
+    // Only lists and flat vectors have a buffer to iterate over.
+    malValueIter begin() const { return m_buffer->m_items.begin() + m_offset; }
+    malValueIter end() const { return begin() + m_count; }
+
 private:
-    malValueVec* const m_items;
+    malValuePtr vectorItem(int index) const;
+
+    malSequenceBufferPtr m_buffer;
+    const int m_offset;
+    const int m_count;
 };
 
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
+    malList(malValueVec* items) : malSequence(LIST, items) { }
     malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(LIST, begin, end) { }
+    malList(const malSequenceBufferPtr& buffer, int offset, int count)
+        : malSequence(LIST, buffer, offset, count) { }
     malList(const malList& that, malValuePtr meta)
         : malSequence(that, meta) { }
+    ~malList();
+
+    static bool hasType(Type type) { return type == LIST; }
+
+    using malSequence::begin;
+    using malSequence::end;
 
     virtual String print(bool readably) const;
     virtual malValuePtr eval(malEnvPtr env);
@@ -204,14 +456,31 @@ public:
     WITH_META(malList);
 };
 
+// A vector of up to MAX_FLAT items is flat: it keeps them in its buffer
+// as a list does, which costs the least for the small vectors most code
+// makes. Longer ones are malTrieVectors. The mal::vector() functions pick
+// whichever fits.
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
-    malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+    typedef PersistentVector<malValuePtr> Items;
+    typedef Items::Transient Transient;
+
+    static const int MAX_FLAT = 32;
+
+    malVector(malValueVec* items) : malSequence(VECTOR, items) { }
     malVector(const malVector& that, malValuePtr meta)
         : malSequence(that, meta) { }
 
+    static bool hasType(Type type) { return type == VECTOR; }
+
+    bool isFlat() const { return count() <= MAX_FLAT; }
+
+    // The trie of a vector which isn't flat.
+    const Items& items() const;
+
+    // Replaces the items at the given indices, one past the end included.
+    malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
+
     virtual malValuePtr eval(malEnvPtr env);
     virtual String print(bool readably) const;
 
@@ -219,12 +488,44 @@ public:
                              malValueIter argsEnd) const;
 
     WITH_META(malVector);
+
+protected:
+    malVector(int count) : malSequence(VECTOR, count) { }
 };
 
+// A vector too long to be flat, whose items are a persistent vector
+// (PersistentVector.h), so conj and assoc share all but O(log32 n) of the
+// old vector's storage.
+class malTrieVector : public malVector {
+public:
+    malTrieVector(const Items& items)
+        : malVector(items.size()), m_items(items) { }
+    malTrieVector(const malTrieVector& that, malValuePtr meta)
+        : malVector(that, meta), m_items(that.m_items) { }
+
+    virtual void visitRefs(Visitor& visitor) const;
+    virtual void clearRefs();
+
+    WITH_META(malTrieVector);
+
+private:
+    friend class malVector;
+    Items m_items;
+};
+
+inline const malVector::Items& malVector::items() const
+{
+    return static_cast<const malTrieVector*>(this)->m_items;
+}
+
 class malApplicable : public malValue {
 public:
-    malApplicable() { }
-    malApplicable(malValuePtr meta) : malValue(meta) { }
+    malApplicable(Type type) : malValue(type) { }
+    malApplicable(Type type, malValuePtr meta) : malValue(type, meta) { }
+
+    static bool hasType(Type type) {
+        return type >= BUILTIN && type <= LAMBDA;
+    }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd) const = 0;
@@ -232,12 +533,19 @@ public:
 
 class malHash : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
+    // Keys are malString or malKeyword values.
+    struct KeyTraits {
+        static size_t hash(const malValuePtr& key);
+        static bool equal(const malValuePtr& lhs, const malValuePtr& rhs);
+    };
+    typedef HashTrie<malValuePtr, malValuePtr, KeyTraits> Map;
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
     malHash(const malHash::Map& map);
     malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    : malValue(HASH, meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+
+    static bool hasType(Type type) { return type == HASH; }
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
@@ -247,14 +555,21 @@ public:
     malValuePtr keys() const;
     malValuePtr values() const;
 
+    // Whether this is already a value, rather than a literal whose values
+    // are still to be evaluated.
+    bool isEvaluated() const { return m_isEvaluated; }
+
     virtual String print(bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
+    virtual void visitRefs(Visitor& visitor) const;
+    virtual void clearRefs();
+
     WITH_META(malHash);
 
 private:
-    const Map m_map;
+    Map m_map;
     const bool m_isEvaluated;
 };
 
@@ -265,10 +580,12 @@ public:
                                     malValueIter argsEnd);
 
     malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    : malApplicable(BUILTIN), m_name(name), m_handler(handler) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(BUILTIN, meta), m_name(that.m_name), m_handler(that.m_handler) { }
+
+    static bool hasType(Type type) { return type == BUILTIN; }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
@@ -290,16 +607,62 @@ private:
     ApplyFunc* m_handler;
 };
 
+// Code which the analyzer (Analyzer.h) made from an AST, for the
+// analyze-then-execute mode.
+class malCode : public RefCounted {
+public:
+    // What the code is, for the few places which treat some kinds
+    // specially, without needing RTTI to tell.
+    enum Kind {
+        TREE,           // made by analyze()
+        CONSTANT,       // analyzed code which only returns a value
+        CHUNK,          // bytecode made by compile()
+    };
+
+    malCode(malValuePtr source, Kind kind = TREE)
+    : m_source(source), m_kind(kind) { }
+
+    Kind kind() const { return m_kind; }
+
+    // Runs the code in env, trampolining tail calls.
+    malValuePtr run(malEnvPtr env) const;
+
+    // Evaluates the code in env. Code in tail position may instead leave
+    // the code to run in its place in next, and its env in env.
+    virtual malValuePtr step(malEnvPtr& env, malCodePtr& next) const = 0;
+
+    // As run, for code which may skip the trampoline because it never
+    // makes a tail call.
+    virtual malValuePtr eval(const malEnvPtr& env) const { return run(env); }
+
+    // The form this was made from, for DEBUG-EVAL.
+    malValuePtr source() const { return m_source; }
+
+    virtual void visitRefs(Visitor& visitor) const {
+        visitRef(visitor, m_source);
+    }
+    virtual void clearRefs() { m_source = NULL; }
+
+private:
+    malValuePtr m_source;
+    const Kind m_kind;
+};
+
 class malLambda : public malApplicable {
 public:
     malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(const malEnv::Params& params, malValuePtr body, malEnvPtr env,
+              malCodePtr code);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
 
+    static bool hasType(Type type) { return type == LAMBDA; }
+
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
     malValuePtr getBody() const { return m_body; }
+    malCodePtr getCode() const { return m_code; }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -312,20 +675,33 @@ public:
 
     bool isMacro() const { return m_isMacro; }
 
+    // Different for every lambda made, even one made where another was
+    // freed, so it tells a macro from its redefinition.
+    unsigned serial() const { return m_serial; }
+
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    virtual void visitRefs(Visitor& visitor) const;
+    virtual void clearRefs();
+
 private:
-    const StringVec   m_bindings;
-    const malValuePtr m_body;
-    const malEnvPtr   m_env;
+    const malEnv::Params m_params;
+    malValuePtr       m_body;
+    malEnvPtr         m_env;
+    malCodePtr        m_code;
     const bool        m_isMacro;
+    const unsigned    m_serial;
+
+    static unsigned s_serials;
 };
 
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
+    malAtom(malValuePtr value) : malValue(ATOM), m_value(value) { }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(ATOM, meta), m_value(that.m_value) { }
+
+    static bool hasType(Type type) { return type == ATOM; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this->m_value->isEqualTo(rhs);
@@ -339,6 +715,15 @@ public:
 
     malValuePtr reset(malValuePtr value) { return m_value = value; }
 
+    virtual void visitRefs(Visitor& visitor) const {
+        malValue::visitRefs(visitor);
+        visitRef(visitor, m_value);
+    }
+    virtual void clearRefs() {
+        malValue::clearRefs();
+        m_value = NULL;
+    }
+
     WITH_META(malAtom);
 
 private:
@@ -357,6 +742,8 @@ namespace mal {
     malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malEnv::Params&, malValuePtr, malEnvPtr,
+                       malCodePtr);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
@@ -369,6 +756,7 @@ namespace mal {
     malValuePtr trueValue();
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
+    malValuePtr vector(const malVector::Items& items);
 };
 
 #endif // INCLUDE_TYPES_H
@@ -0,0 +1,499 @@
+#include "Bytecode.h"
+#include "Collector.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <iostream>
+
+// GCC and clang can dispatch through a table of label addresses, which
+// predicts better than a switch.
+#ifndef USE_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+#endif
+
+namespace {
+
+typedef malChunk::Word Word;
+
+struct Frame {
+    malCodePtr chunk; // keeps the code alive while it runs
+    int pc;
+    malEnvPtr env;
+    int base;         // of the frame's part of the stack
+    int envDepth;     // frames pushed onto env since the call
+};
+
+// The stack and frames of one run of the machine. Builtins such as map
+// call back into lambdas, which starts another run, so they are kept
+// for reuse rather than made each time.
+struct Machine {
+    malValueVec stack;
+    std::vector<Frame> frames;
+};
+
+class MachineLease {
+public:
+    MachineLease() {
+        if (s_spare.empty()) {
+            m_machine = new Machine;
+        }
+        else {
+            m_machine = s_spare.back();
+            s_spare.pop_back();
+        }
+    }
+
+    ~MachineLease() {
+        s_spare.push_back(m_machine);
+    }
+
+    Machine& operator * () const { return *m_machine; }
+
+private:
+    MachineLease(const MachineLease&); // no copy ctor
+    MachineLease& operator = (const MachineLease&); // no assignments
+
+    Machine* m_machine;
+    static std::vector<Machine*> s_spare;
+};
+
+std::vector<Machine*> MachineLease::s_spare;
+
+bool isChunk(const malCodePtr& code)
+{
+    return code && code->kind() == malCode::CHUNK;
+}
+
+void traceForms(const malChunk* chunk, int pc, const malEnvPtr& env)
+{
+    if (!env->debugEval()) {
+        return;
+    }
+    auto it = std::lower_bound(chunk->m_forms.begin(), chunk->m_forms.end(),
+                               std::make_pair(pc, malValuePtr()),
+                               [](const std::pair<int, malValuePtr>& a,
+                                  const std::pair<int, malValuePtr>& b) {
+                                   return a.first < b.first;
+                               });
+    for (; it != chunk->m_forms.end() && it->first == pc; ++it) {
+        std::cout << "EVAL: " << it->second->print(true) << "\n";
+    }
+}
+
+void clear(malValueVec& stack, int from, int to)
+{
+    for (int i = from; i < to; i++) {
+        stack[i] = malValuePtr();
+    }
+}
+
+// Makes room for a frame of chunk on top of the stack.
+void reserve(malValueVec& stack, int sp, const malChunk* chunk)
+{
+    if ((int)stack.size() < sp + chunk->m_maxStack) {
+        stack.resize(std::max(2 * stack.size(),
+                              size_t(sp + chunk->m_maxStack)));
+    }
+}
+
+const malChunk::Handler* findHandler(const malChunk* chunk, int pc)
+{
+    for (auto it = chunk->m_handlers.begin(), end = chunk->m_handlers.end();
+            it != end; ++it) {
+        if (pc >= it->start && pc < it->end) {
+            return &*it;
+        }
+    }
+    return NULL;
+}
+
+// Calls the function under argCount arguments on top of the stack. A
+// lambda with a chunk gets a frame, in place of the current one for a
+// tail call, and true is returned. Anything else is applied, and its
+// result replaces the function and arguments.
+bool call(Machine& machine, int& sp, int argCount, bool isTail)
+{
+    malValueVec& stack = machine.stack;
+    int callee = sp - argCount - 1;
+    malValuePtr op = stack[callee];
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    malValueIter argsBegin = stack.begin() + callee + 1;
+    malValueIter argsEnd = stack.begin() + sp;
+
+    if (lambda && isChunk(lambda->getCode())) {
+        malEnvPtr env = lambda->makeEnv(argsBegin, argsEnd);
+        if (isTail) {
+            Frame& frame = machine.frames.back();
+            clear(stack, frame.base, sp);
+            sp = frame.base;
+            frame.chunk = lambda->getCode();
+            frame.pc = 0;
+            frame.env = env;
+            frame.envDepth = 0;
+        }
+        else {
+            clear(stack, callee, sp);
+            sp = callee;
+            Frame frame = { lambda->getCode(), 0, env, sp, 0 };
+            machine.frames.push_back(frame);
+        }
+        reserve(stack, sp, static_cast<const malChunk*>(
+                               lambda->getCode().ptr()));
+        return true;
+    }
+
+    malValuePtr result = lambda ? lambda->apply(argsBegin, argsEnd)
+                                : APPLY(op, argsBegin, argsEnd);
+    clear(stack, callee + 1, sp);
+    stack[callee] = result;
+    sp = callee + 1;
+    return false;
+}
+
+// Returns the value on top of the stack to the frame below.
+void popFrame(Machine& machine, int& sp)
+{
+    malValuePtr result = machine.stack[sp - 1];
+    int base = machine.frames.back().base;
+    clear(machine.stack, base, sp);
+    sp = base;
+    machine.frames.pop_back();
+    machine.stack[sp++] = result;
+}
+
+malValuePtr makeHash(const malValuePtr& keys, malValueIter values, int count)
+{
+    const malSequence* seq = STATIC_CAST(malSequence, keys);
+    malHash::Map map;
+    for (int i = 0; i < count; i++) {
+        map = map.insert(seq->item(i), values[i]);
+    }
+    return mal::hash(map);
+}
+
+// Ops jump to the next with a computed goto, which doesn't run
+// destructors, so the locals of an op mustn't have any.
+malValuePtr execute(const malChunk* entry, const malEnvPtr& entryEnv)
+{
+    MachineLease lease;
+    malValueVec& stack = (*lease).stack;
+    std::vector<Frame>& frames = (*lease).frames;
+
+    Frame first = { entry, 0, entryEnv, 0, 0 };
+    frames.push_back(first);
+    reserve(stack, 0, entry);
+
+    Frame* frame;
+    const malChunk* chunk;
+    const Word* code;
+    int pc;
+    int sp = 0;
+
+#define LOAD_FRAME() \
+    frame = &frames.back(); \
+    chunk = static_cast<const malChunk*>(frame->chunk.ptr()); \
+    code = &chunk->m_code[0]; \
+    pc = frame->pc
+
+#define PUSH(value) stack[sp++] = (value)
+#define TOP() stack[sp - 1]
+
+#if USE_COMPUTED_GOTO
+#define MAL_CHUNK_OP_LABEL(op) &&op_##op,
+#define MAL_CHUNK_TRACE_LABEL(op) &&trace,
+    static const void* const ops[] = {
+        MAL_CHUNK_OPS(MAL_CHUNK_OP_LABEL)
+    };
+    static const void* const traced[] = {
+        MAL_CHUNK_OPS(MAL_CHUNK_TRACE_LABEL)
+    };
+#undef MAL_CHUNK_OP_LABEL
+#undef MAL_CHUNK_TRACE_LABEL
+    const void* const* table;
+#define UPDATE_TRACE() table = malEnv::mayDebugEval() ? traced : ops
+#define CASE(op) op_##op:
+#define DISPATCH() goto *table[code[pc++]]
+#else
+    bool tracing;
+#define UPDATE_TRACE() tracing = malEnv::mayDebugEval()
+#define CASE(op) case malChunk::op:
+#define DISPATCH() goto dispatch
+#endif
+
+    while (1) {
+        String error;
+        malValuePtr exception;
+        bool isError = false;
+        bool isEmptyInput = false;
+
+        try {
+            LOAD_FRAME();
+            UPDATE_TRACE();
+
+#if USE_COMPUTED_GOTO
+            DISPATCH();
+trace:
+            pc--;
+            traceForms(chunk, pc, frame->env);
+            goto *ops[code[pc++]];
+#else
+dispatch:
+            if (tracing) {
+                traceForms(chunk, pc, frame->env);
+            }
+            switch (code[pc++]) {
+#endif
+
+            CASE(CONST) {
+                PUSH(chunk->m_constants[code[pc]]);
+                pc += 1;
+                DISPATCH();
+            }
+
+            CASE(LOCAL) {
+                int n = code[pc + 2];
+                malEnv::Id id = chunk->m_names[n].id();
+                if (malValuePtr* value =
+                        frame->env->slot(code[pc], code[pc + 1], id)) {
+                    PUSH(*value);
+                }
+                else {
+                    PUSH(frame->env->get(id, chunk->m_caches[n]));
+                }
+                pc += 3;
+                DISPATCH();
+            }
+
+            CASE(GLOBAL) {
+                int n = code[pc];
+                PUSH(frame->env->get(chunk->m_names[n].id(),
+                                     chunk->m_caches[n]));
+                pc += 1;
+                DISPATCH();
+            }
+
+            CASE(DEF) {
+                frame->env->set(chunk->m_names[code[pc]], TOP());
+                pc += 1;
+                UPDATE_TRACE();
+                DISPATCH();
+            }
+
+            CASE(DEFMACRO) {
+                TOP() = mal::macro(*VALUE_CAST(malLambda, TOP()));
+                frame->env->set(chunk->m_names[code[pc]], TOP());
+                pc += 1;
+                UPDATE_TRACE();
+                DISPATCH();
+            }
+
+            CASE(POP) {
+                stack[--sp] = malValuePtr();
+                DISPATCH();
+            }
+
+            CASE(JUMP) {
+                pc = code[pc];
+                DISPATCH();
+            }
+
+            CASE(JUMP_IF_FALSE) {
+                bool isTrue = stack[--sp].isTrue();
+                stack[sp] = malValuePtr();
+                pc = isTrue ? pc + 1 : code[pc];
+                DISPATCH();
+            }
+
+            CASE(CLOSURE) {
+                const malChunk::Function& function =
+                    chunk->m_functions[code[pc]];
+                PUSH(mal::lambda(function.params, function.body, frame->env,
+                                 function.chunk));
+                pc += 1;
+                DISPATCH();
+            }
+
+            CASE(CHECK_MACRO) {
+                const malLambda* lambda = DYNAMIC_CAST(malLambda, TOP());
+                if (lambda && lambda->isMacro()) {
+                    // It wasn't a macro when this was compiled.
+                    const malList* list =
+                        STATIC_CAST(malList, chunk->m_constants[code[pc]]);
+                    TOP() = compile(lambda->apply(list->begin() + 1,
+                                                  list->end()),
+                                    frame->env)->eval(frame->env);
+                    pc = code[pc + 1];
+                    UPDATE_TRACE();
+                    DISPATCH();
+                }
+                pc += 2;
+                DISPATCH();
+            }
+
+            CASE(CALL) {
+                frame->pc = pc + 1;
+                if (call(*lease, sp, code[pc], false)) {
+                    LOAD_FRAME();
+                    Collector::collectIfNeeded();
+                }
+                else {
+                    pc += 1;
+                }
+                UPDATE_TRACE();
+                DISPATCH();
+            }
+
+            CASE(TAIL_CALL) {
+                if (!call(*lease, sp, code[pc], true)) {
+                    goto doReturn;
+                }
+                LOAD_FRAME();
+                Collector::collectIfNeeded();
+                UPDATE_TRACE();
+                DISPATCH();
+            }
+
+            CASE(RETURN) {
+doReturn:
+                if (frames.size() == 1) {
+                    malValuePtr result = TOP();
+                    clear(stack, frame->base, sp);
+                    frames.pop_back();
+                    return result;
+                }
+                popFrame(*lease, sp);
+                LOAD_FRAME();
+                UPDATE_TRACE();
+                DISPATCH();
+            }
+
+            CASE(PUSH_ENV) {
+                frame->env = new malEnv(frame->env, code[pc]);
+                frame->envDepth++;
+                pc += 1;
+                DISPATCH();
+            }
+
+            CASE(BIND) {
+                frame->env->set(chunk->m_names[code[pc]], stack[--sp]);
+                stack[sp] = malValuePtr();
+                pc += 1;
+                UPDATE_TRACE();
+                DISPATCH();
+            }
+
+            CASE(POP_ENV) {
+                frame->env = frame->env->getOuter();
+                frame->envDepth--;
+                UPDATE_TRACE();
+                DISPATCH();
+            }
+
+            CASE(VECTOR) {
+                int count = code[pc];
+                malValueVec* items = new malValueVec(stack.begin() + sp - count,
+                                                     stack.begin() + sp);
+                clear(stack, sp - count, sp);
+                sp -= count;
+                PUSH(mal::vector(items));
+                pc += 1;
+                DISPATCH();
+            }
+
+            CASE(HASH) {
+                int count = code[pc + 1];
+                stack[sp - count] = makeHash(chunk->m_constants[code[pc]],
+                                             stack.begin() + sp - count,
+                                             count);
+                clear(stack, sp - count + 1, sp);
+                sp -= count - 1;
+                pc += 2;
+                DISPATCH();
+            }
+
+            CASE(THROW) {
+                malValuePtr value = chunk->m_constants[code[pc]];
+                pc += 2;
+                if (code[pc - 1]) {
+                    throw STATIC_CAST(malString, value)->value();
+                }
+                throw value;
+            }
+
+#if !USE_COMPUTED_GOTO
+            }
+#endif
+        }
+        catch (String& s) {
+            error = s;
+            isError = true;
+            exception = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            isEmptyInput = true;
+        }
+        catch (malValuePtr& o) {
+            exception = o;
+        }
+
+        // Unwind to the innermost handler. The pc of each frame is past
+        // the instruction it stopped in, so pc - 1 is in its range.
+        frame->pc = pc;
+        while (!frames.empty()) {
+            frame = &frames.back();
+            chunk = static_cast<const malChunk*>(frame->chunk.ptr());
+            if (const malChunk::Handler* handler =
+                    findHandler(chunk, frame->pc - 1)) {
+                int height = frame->base + handler->height;
+                clear(stack, height, sp);
+                sp = height;
+                for (; frame->envDepth > handler->envDepth;
+                        frame->envDepth--) {
+                    frame->env = frame->env->getOuter();
+                }
+                if (isEmptyInput) {
+                    // Not an error, continue as if we got nil
+                    PUSH(mal::nilValue());
+                    frame->pc = handler->end;
+                }
+                else {
+                    PUSH(exception);
+                    frame->pc = handler->target;
+                }
+                break;
+            }
+            clear(stack, frame->base, sp);
+            sp = frame->base;
+            frames.pop_back();
+        }
+
+        if (frames.empty()) {
+            if (isEmptyInput) {
+                throw malEmptyInputException();
+            }
+            if (isError) {
+                throw error;
+            }
+            throw exception;
+        }
+    }
+
+#undef LOAD_FRAME
+#undef PUSH
+#undef TOP
+#undef UPDATE_TRACE
+#undef CASE
+#undef DISPATCH
+}
+
+}
+
+malValuePtr malChunk::eval(const malEnvPtr& env) const
+{
+    return execute(this, env);
+}
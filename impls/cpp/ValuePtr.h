@@ -0,0 +1,91 @@
+#ifndef INCLUDE_VALUEPTR_H
+#define INCLUDE_VALUEPTR_H
+
+#include "RefCountedPtr.h"
+
+#include <cstdint>
+
+class malValue;
+
+// A reference to a malValue which holds small integers (fixnums) and the
+// nil, true and false constants inline, so that they need no allocation
+// and no reference counting. Everything else is a reference counted
+// pointer, as with RefCountedPtr.
+//
+// A set low bit tags a fixnum. The constants are the small even values
+// 2, 4 and 6, where no object can live. Code which needs a real object
+// for an inline value gets one from ptr() or ->. The constants map to
+// their singleton objects, and a fixnum is boxed into a malInteger,
+// which then replaces it in this reference.
+class malValuePtr {
+public:
+    enum Constant { NIL = 2, TRUE = 4, FALSE = 6 };
+
+    malValuePtr() : m_bits(0) { }
+
+    inline malValuePtr(malValue* object);
+
+    malValuePtr(const malValuePtr& rhs) : m_bits(rhs.m_bits)
+    { acquire(); }
+
+    ~malValuePtr() {
+        release();
+    }
+
+    const malValuePtr& operator = (const malValuePtr& rhs) {
+        rhs.acquire();
+        release();
+        m_bits = rhs.m_bits;
+        return *this;
+    }
+
+    static malValuePtr constant(Constant c) {
+        return malValuePtr(c, true);
+    }
+
+    static bool fitsFixnum(int64_t value) {
+        return value >= INTPTR_MIN / 2 && value <= INTPTR_MAX / 2;
+    }
+
+    static malValuePtr fixnum(int64_t value) {
+        return malValuePtr((static_cast<uintptr_t>(value) << 1) | 1, true);
+    }
+
+    bool isFixnum() const { return m_bits & 1; }
+    int64_t fixnumValue() const {
+        return static_cast<intptr_t>(m_bits) >> 1;
+    }
+
+    // True for fixnums, the constants and NULL.
+    bool isImmediate() const { return isFixnum() || m_bits <= FALSE; }
+
+    bool isTrue() const { return m_bits != NIL && m_bits != FALSE; }
+
+    bool operator == (const malValuePtr& rhs) const {
+        return m_bits == rhs.m_bits;
+    }
+
+    bool operator != (const malValuePtr& rhs) const {
+        return m_bits != rhs.m_bits;
+    }
+
+    operator bool () const {
+        return m_bits != 0;
+    }
+
+    malValue* operator -> () const { return ptr(); }
+    inline malValue* ptr() const;
+
+private:
+    malValuePtr(uintptr_t bits, bool) : m_bits(bits) { }
+
+    inline void acquire() const;
+    inline void release() const;
+    malValue* box() const;
+
+    static malValue* const s_constants[];
+
+    mutable uintptr_t m_bits;
+};
+
+#endif // INCLUDE_VALUEPTR_H
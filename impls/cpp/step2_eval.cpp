@@ -1,5 +1,6 @@
 #include "MAL.h"
 
+#include "Collector.h"
 #include "Environment.h"
 #include "ReadLine.h"
 #include "Types.h"
@@ -53,6 +54,8 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 {
     // std::cout << "EVAL: " << PRINT(ast) << "\n";
 
+    Collector::collectIfNeeded();
+
     return ast->eval(env);
 }
 
@@ -1,5 +1,6 @@
 #include "MAL.h"
 
+#include "Collector.h"
 #include "Environment.h"
 #include "ReadLine.h"
 #include "Types.h"
@@ -51,8 +52,9 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         env = replEnv;
     }
 
-    const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-    if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
+    Collector::collectIfNeeded();
+
+    if (env->debugEval()) {
         std::cout << "EVAL: " << PRINT(ast) << "\n";
     }
 
@@ -1,5 +1,6 @@
 #include "MAL.h"
 
+#include "Collector.h"
 #include "Environment.h"
 #include "ReadLine.h"
 #include "Types.h"
@@ -53,12 +54,16 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         env = replEnv;
     }
     while (1) {
+        Collector::collectIfNeeded();
 
-       const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-       if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
+       if (env->debugEval()) {
            std::cout << "EVAL: " << PRINT(ast) << "\n";
        }
 
+        if (ast.isImmediate()) {
+            return ast;
+        }
+
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
             return ast->eval(env);
@@ -104,7 +109,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             if (special == "if") {
                 checkArgsBetween("if", 2, 3, argCount);
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
+                bool isTrue = EVAL(list->item(1), env).isTrue();
                 if (!isTrue && (argCount == 2)) {
                     return mal::nilValue();
                 }
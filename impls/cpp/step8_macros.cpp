@@ -1,5 +1,6 @@
 #include "MAL.h"
 
+#include "Collector.h"
 #include "Environment.h"
 #include "ReadLine.h"
 #include "Types.h"
@@ -78,12 +79,16 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         env = replEnv;
     }
     while (1) {
+        Collector::collectIfNeeded();
 
-       const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-       if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
+       if (env->debugEval()) {
            std::cout << "EVAL: " << PRINT(ast) << "\n";
        }
 
+        if (ast.isImmediate()) {
+            return ast;
+        }
+
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
             return ast->eval(env);
@@ -138,7 +143,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             if (special == "if") {
                 checkArgsBetween("if", 2, 3, argCount);
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
+                bool isTrue = EVAL(list->item(1), env).isTrue();
                 if (!isTrue && (argCount == 2)) {
                     return mal::nilValue();
                 }
@@ -181,14 +186,16 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 ast = lambda->apply(list->begin()+1, list->end());
                 continue; // TCO
             }
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
+            malArgs args(list->count() - 1);
+            list->evalItems(env, args, 1);
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin(), items->end());
+            env = lambda->makeEnv(args.begin(), args.end());
             continue; // TCO
         }
         else {
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            return APPLY(op, items->begin(), items->end());
+            malArgs args(list->count() - 1);
+            list->evalItems(env, args, 1);
+            return APPLY(op, args.begin(), args.end());
         }
     }
 }
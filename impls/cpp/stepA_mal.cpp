@@ -1,6 +1,10 @@
 #include "MAL.h"
 
+#include "Analyzer.h"
+#include "Bytecode.h"
+#include "Collector.h"
 #include "Environment.h"
+#include "MacroCache.h"
 #include "ReadLine.h"
 #include "Types.h"
 
@@ -14,16 +18,36 @@ static void installFunctions(malEnvPtr env);
 
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
-static malValuePtr quasiquote(malValuePtr obj);
 
 static ReadLine s_readLine("~/.mal-history");
 
 static malEnvPtr replEnv(new malEnv);
 
+// Set by --analyze, which runs forms as trees of code made by analyze()
+// instead of walking them in EVAL, and by --compile, which runs them as
+// bytecode made by compile().
+static bool s_analyze = false;
+static bool s_compile = false;
+
 int main(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
+    for (; argc > 1; argc--, argv++) {
+        String flag = argv[1];
+        if (flag == "--analyze") {
+            s_analyze = true;
+        }
+        else if (flag == "--compile") {
+            s_compile = true;
+        }
+        else if (flag == "--cache-macros") {
+            MacroCache::enable();
+        }
+        else {
+            break;
+        }
+    }
     installCore(replEnv);
     installFunctions(replEnv);
     makeArgv(replEnv, argc - 2, argv + 2);
@@ -81,13 +105,23 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     if (!env) {
         env = replEnv;
     }
+    if (s_analyze) {
+        return analyze(ast, env)->run(env);
+    }
+    if (s_compile) {
+        return compile(ast, env)->eval(env);
+    }
     while (1) {
+        Collector::collectIfNeeded();
 
-       const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-       if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
+       if (env->debugEval()) {
            std::cout << "EVAL: " << PRINT(ast) << "\n";
        }
 
+        if (ast.isImmediate()) {
+            return ast;
+        }
+
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
             return ast->eval(env);
@@ -95,26 +129,27 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
         // From here on down we are evaluating a non-empty list.
         // First handle the special forms.
-        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
+        const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+        if (symbol && symbol->specialForm() != malSymbol::NONE) {
+            malSymbol::SpecialForm special = symbol->specialForm();
             int argCount = list->count() - 1;
 
-            if (special == "def!") {
+            if (special == malSymbol::DEF) {
                 checkArgsIs("def!", 2, argCount);
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
+                return env->set(id->name(), EVAL(list->item(2), env));
             }
 
-            if (special == "defmacro!") {
+            if (special == malSymbol::DEFMACRO) {
                 checkArgsIs("defmacro!", 2, argCount);
 
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
                 malValuePtr body = EVAL(list->item(2), env);
                 const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
+                return env->set(id->name(), mal::macro(*lambda));
             }
 
-            if (special == "do") {
+            if (special == malSymbol::DO) {
                 checkArgsAtLeast("do", 1, argCount);
 
                 for (int i = 1; i < argCount; i++) {
@@ -124,7 +159,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "fn*") {
+            if (special == malSymbol::FN) {
                 checkArgsIs("fn*", 2, argCount);
 
                 const malSequence* bindings =
@@ -139,10 +174,10 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 return mal::lambda(params, list->item(2), env);
             }
 
-            if (special == "if") {
+            if (special == malSymbol::IF) {
                 checkArgsBetween("if", 2, 3, argCount);
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
+                bool isTrue = EVAL(list->item(1), env).isTrue();
                 if (!isTrue && (argCount == 2)) {
                     return mal::nilValue();
                 }
@@ -150,34 +185,34 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "let*") {
+            if (special == malSymbol::LET) {
                 checkArgsIs("let*", 2, argCount);
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
                 int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
+                malEnvPtr inner(new malEnv(env, count / 2));
                 for (int i = 0; i < count; i += 2) {
                     const malSymbol* var =
                         VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                    inner->set(var->name(), EVAL(bindings->item(i+1), inner));
                 }
                 ast = list->item(2);
                 env = inner;
                 continue; // TCO
             }
 
-            if (special == "quasiquote") {
+            if (special == malSymbol::QUASIQUOTE) {
                 checkArgsIs("quasiquote", 1, argCount);
                 ast = quasiquote(list->item(1));
                 continue; // TCO
             }
 
-            if (special == "quote") {
+            if (special == malSymbol::QUOTE) {
                 checkArgsIs("quote", 1, argCount);
                 return list->item(1);
             }
 
-            if (special == "try*") {
+            if (special == malSymbol::TRY) {
                 malValuePtr tryBody = list->item(1);
 
                 if (argCount == 1) {
@@ -216,8 +251,8 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
                 if (excVal) {
                     // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
+                    env = malEnvPtr(new malEnv(env, 1));
+                    env->set(excSym->name(), excVal);
                     ast = catchBlock->item(2);
                 }
                 continue; // TCO
@@ -225,20 +260,25 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         }
 
         // Now we're left with the case of a regular list to be evaluated.
-        malValuePtr op = EVAL(list->item(0), env);
+        // A symbol's value comes straight from its cache, unless DEBUG-EVAL
+        // wants to see it.
+        malValuePtr op = symbol && !malEnv::mayDebugEval()
+            ? symbol->lookup(env) : EVAL(list->item(0), env);
         if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
             if (lambda->isMacro()) {
-                ast = lambda->apply(list->begin()+1, list->end());
+                ast = MacroCache::expand(list, lambda);
                 continue; // TCO
             }
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
+            malArgs args(list->count() - 1);
+            list->evalItems(env, args, 1);
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin(), items->end());
+            env = lambda->makeEnv(args.begin(), args.end());
             continue; // TCO
         }
         else {
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            return APPLY(op, items->begin(), items->end());
+            malArgs args(list->count() - 1);
+            list->evalItems(env, args, 1);
+            return APPLY(op, args.begin(), args.end());
         }
     }
 }
@@ -273,7 +313,7 @@ static malValuePtr starts_with(const malValuePtr ast, const char* sym)
     return list->item(1);
 }
 
-static malValuePtr quasiquote(malValuePtr obj)
+malValuePtr quasiquote(malValuePtr obj)
 {
     if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
         return mal::list(mal::symbol("quote"), obj);
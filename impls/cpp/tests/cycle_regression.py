@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+#
+# Runs tests/cycles.mal, which makes garbage cycles, and fails if the live
+# object count doesn't come back down after a collection, or if it grew
+# with the iteration count before the collection, which means that the
+# automatic collections didn't run.
+#
+#   tests/cycle_regression.py [STEP] [ITERATIONS] [SLACK]
+
+import os
+import subprocess
+import sys
+
+here = os.path.dirname(os.path.abspath(__file__))
+impl_dir = os.path.dirname(here)
+tests_dir = os.path.join(impl_dir, '..', 'tests')
+
+step = sys.argv[1] if len(sys.argv) > 1 else 'stepA_mal'
+iterations = int(sys.argv[2]) if len(sys.argv) > 2 else 20000
+slack = int(sys.argv[3]) if len(sys.argv) > 3 else 200
+
+out = subprocess.check_output([os.path.join(impl_dir, step),
+                               os.path.join(here, 'cycles.mal'),
+                               str(iterations)],
+                              cwd=tests_dir, universal_newlines=True)
+counts = [line for line in out.splitlines()
+          if line.startswith('live objects:')]
+if not counts:
+    sys.exit('FAIL: no live object counts in the output:\n' + out)
+before, after, collected = map(int, counts[-1].split()[2:])
+
+print('live objects: %d before %d iterations, %d after, %d after (gc)'
+      % (before, iterations, after, collected))
+
+if collected - before > slack:
+    sys.exit('FAIL: %d objects left after (gc)' % (collected - before))
+if after - before > max(slack, iterations):
+    sys.exit('FAIL: %d objects built up before (gc)' % (after - before))
+print('PASS')
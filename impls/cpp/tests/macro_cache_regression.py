@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+#
+# Runs tests/macro_cache.mal under --cache-macros, and fails if a loop
+# calling a macro kept using the old expansion after the macro was
+# redefined, or if it expanded the call on every pass instead of reusing
+# the cached expansion.
+#
+#   tests/macro_cache_regression.py [STEP] [ITERATIONS]
+
+import os
+import subprocess
+import sys
+
+here = os.path.dirname(os.path.abspath(__file__))
+impl_dir = os.path.dirname(here)
+tests_dir = os.path.join(impl_dir, '..', 'tests')
+
+step = sys.argv[1] if len(sys.argv) > 1 else 'stepA_mal'
+iterations = int(sys.argv[2]) if len(sys.argv) > 2 else 100
+
+out = subprocess.check_output([os.path.join(impl_dir, step),
+                               '--cache-macros',
+                               os.path.join(here, 'macro_cache.mal'),
+                               str(iterations)],
+                              cwd=tests_dir, universal_newlines=True)
+runs = [line for line in out.splitlines() if line.startswith('runs:')]
+if not runs:
+    sys.exit('FAIL: no run results in the output:\n' + out)
+results = list(map(int, runs[-1].split()[1:]))
+failed = False
+
+for name, (total, expanded, avoided), scale in zip(
+        ('first', 'second'), (results[0:3], results[3:6]), (2, 3)):
+    print('%s run: total %d, %d expansions, %d avoided'
+          % (name, total, expanded, avoided))
+    if total != scale * iterations:
+        print('FAIL: %s run added up to %d, not %d'
+              % (name, total, scale * iterations))
+        failed = True
+    if avoided < iterations - 1:
+        print('FAIL: %s run avoided only %d of %d expansions'
+              % (name, avoided, iterations))
+        failed = True
+
+if failed:
+    sys.exit(1)
+print('PASS')
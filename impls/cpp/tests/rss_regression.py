@@ -0,0 +1,41 @@
+#!/usr/bin/env python3
+#
+# Runs tests/perf3_rss.mal for a small and a large number of iterations
+# and fails if the peak RSS grows with the iteration count, which means
+# that something leaks on every call.
+#
+#   tests/rss_regression.py [STEP] [SMALL] [LARGE] [SLACK_KB]
+
+import os
+import subprocess
+import sys
+
+here = os.path.dirname(os.path.abspath(__file__))
+impl_dir = os.path.dirname(here)
+tests_dir = os.path.join(impl_dir, '..', 'tests')
+
+step = sys.argv[1] if len(sys.argv) > 1 else 'stepA_mal'
+small = int(sys.argv[2]) if len(sys.argv) > 2 else 2000
+large = int(sys.argv[3]) if len(sys.argv) > 3 else 20000
+slack_kb = int(sys.argv[4]) if len(sys.argv) > 4 else 1024
+
+def peak_rss(iterations):
+    proc = subprocess.Popen([os.path.join(impl_dir, step),
+                             os.path.join(here, 'perf3_rss.mal'),
+                             str(iterations)],
+                            cwd=tests_dir, stdout=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    if status != 0:
+        sys.exit('FAIL: %s exited with status %d' % (step, status))
+    return usage.ru_maxrss
+
+small_rss = peak_rss(small)
+large_rss = peak_rss(large)
+growth = large_rss - small_rss
+
+print('peak RSS: %d kB after %d iterations, %d kB after %d'
+      % (small_rss, small, large_rss, large))
+
+if growth > slack_kb:
+    sys.exit('FAIL: peak RSS grew by %d kB' % growth)
+print('PASS')
@@ -0,0 +1,107 @@
+// Times escaping and unescaping of large strings with each scan kernel the
+// CPU supports, against a plain loop over the characters, for text with
+// no, few and many characters that need escaping.
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../cpp-common/escape.h"
+
+using namespace std;
+
+static string naive_escape(const string& s) {
+    string out;
+    for (char c: s) {
+        switch (c) {
+            case '\\': out += R"(\\)"; break;
+            case '\n': out += R"(\n)"; break;
+            case '\t': out += R"(\t)"; break;
+            case '\r': out += R"(\r)"; break;
+            case '\b': out += R"(\b)"; break;
+            case '"':  out += R"(\")"; break;
+            default:   out += c;
+        }
+    }
+    return out;
+}
+
+// One character in every `every` needs escaping, or none if it's 0.
+static string generate(size_t size, size_t every) {
+    const string specials = "\"\\\n\t";
+    string s;
+    s.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        if (every && i % every == every - 1) {
+            s += specials[i / every % specials.size()];
+        } else {
+            s += 'a' + i % 26;
+        }
+    }
+    return s;
+}
+
+template <typename F>
+static double time_mb_per_sec(size_t bytes, int rounds, F f) {
+    using namespace chrono;
+    auto start = steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        f();
+    }
+    auto secs = duration<double>(steady_clock::now() - start).count() / rounds;
+    return bytes / 1e6 / secs;
+}
+
+int main(int argc, char* argv[]) {
+    size_t size = argc > 1 ? stoul(argv[1]) : 1 << 24;
+    int rounds = argc > 2 ? stoi(argv[2]) : 5;
+    constexpr unsigned flags = mal_escape::CONTROL_CHARS | mal_escape::KEEP_UNKNOWN;
+
+    using namespace mal_escape::detail;
+    vector<pair<string, Kernel>> kernels = {{"scalar", findScalar}};
+#ifdef MAL_ESCAPE_X86
+    kernels.push_back({"sse2", findSSE2});
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back({"avx2", findAVX2});
+    }
+#endif
+    auto best = kernel();
+
+    for (size_t every: {0, 100, 10}) {
+        auto input = generate(size, every);
+        auto escaped = naive_escape(input);
+        cout << "1 in " << (every ? to_string(every) : "no") << " escaped, "
+             << input.size() / 1e6 << " MB:" << endl;
+
+        auto naive = time_mb_per_sec(input.size(), rounds, [&] {
+            naive_escape(input);
+        });
+        cout << "  naive loop: escape " << naive << " MB/s" << endl;
+
+        for (auto& [name, k]: kernels) {
+            kernel() = k;
+            string out;
+            auto esc = time_mb_per_sec(input.size(), rounds, [&] {
+                out.clear();
+                mal_escape::escape(out, input.data(), input.size(), flags);
+            });
+            if (out != escaped) {
+                cerr << name << ": escape mismatch" << endl;
+                return 1;
+            }
+            auto unesc = time_mb_per_sec(escaped.size(), rounds, [&] {
+                out.clear();
+                mal_escape::unescape(out, escaped.data(), escaped.size(), flags);
+            });
+            if (out != input) {
+                cerr << name << ": unescape mismatch" << endl;
+                return 1;
+            }
+            cout << "  " << name << (k == best ? " (in use)" : "")
+                 << ": escape " << esc << " MB/s, unescape " << unesc << " MB/s" << endl;
+        }
+        kernel() = best;
+    }
+}
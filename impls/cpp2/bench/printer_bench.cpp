@@ -0,0 +1,49 @@
+// Times pr_str on a nested vector of a million items, the way prn and
+// pr-str see big data structures.
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "../printer.h"
+
+using namespace std;
+
+static MalType generate(size_t items, size_t width) {
+    auto outer = make_shared<MalVector>();
+
+    for (size_t i = 0; i < items; i += width) {
+        auto inner = make_shared<MalVector>();
+        for (size_t j = i; j < i + width && j < items; ++j) {
+            switch (j % 4) {
+                case 0: inner->data.push_back(MalNumber(static_cast<int>(j))); break;
+                case 1: inner->data.push_back(MalKeyword("kw")); break;
+                case 2: inner->data.push_back(MalString("s \"quoted\"")); break;
+                case 3: inner->data.push_back(MalNil()); break;
+            }
+        }
+        outer->data.push_back(inner);
+    }
+
+    return outer;
+}
+
+int main(int argc, char* argv[]) {
+    size_t items = argc > 1 ? stoul(argv[1]) : 1000000;
+    int rounds = argc > 2 ? stoi(argv[2]) : 5;
+    auto value = generate(items, 1000);
+
+    using namespace chrono;
+    string out;
+    auto start = steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        out.clear();
+        pr_str(out, value, true);
+    }
+    auto secs = duration<double>(steady_clock::now() - start).count() / rounds;
+
+    cout << "pr_str: " << items << " items, " << out.size() / 1e6
+         << " MB in " << secs * 1e3 << " msecs ("
+         << out.size() / 1e6 / secs << " MB/s)" << endl;
+}
@@ -0,0 +1,40 @@
+// Times read_str on a large generated program, the way read-string sees
+// big data files.
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../reader.h"
+
+using namespace std;
+
+static string generate(size_t records) {
+    string s = "[";
+
+    for (size_t i = 0; i < records; ++i) {
+        auto n = to_string(i);
+        s += "{:id " + n + ", :name \"record " + n + " \\\"quoted\\\"\"";
+        s += " :tags (tag-" + n + " :kw -" + n + " +" + n + ")";
+        s += " :data [" + n + " " + n + " nil true false]} ; comment\n";
+    }
+
+    return s + "]";
+}
+
+int main(int argc, char* argv[]) {
+    size_t records = argc > 1 ? stoul(argv[1]) : 100000;
+    int rounds = argc > 2 ? stoi(argv[2]) : 5;
+    auto input = generate(records);
+
+    using namespace chrono;
+    auto start = steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        read_str(input);
+    }
+    auto secs = duration<double>(steady_clock::now() - start).count() / rounds;
+
+    cout << "read_str: " << input.size() / 1e6 << " MB in "
+         << secs * 1e3 << " msecs ("
+         << input.size() / 1e6 / secs << " MB/s)" << endl;
+}
@@ -4,6 +4,7 @@
 #include <functional>
 #include <iostream>
 #include <fstream>
+#include <chrono>
 
 #include "core.h"
 #include "reader.h"
@@ -20,7 +21,7 @@ auto arg_transformer(const MalType& arg) {
     );
 }
 
-static inline void argument_count_checker(const vector<MalType>& args, size_t cnt) {
+static inline void argument_count_checker(span<const MalType> args, size_t cnt) {
     if (args.size() != cnt) {
         throw MalRuntimeError("invalid argument count: " + to_string(args.size()));
     }
@@ -33,37 +34,30 @@ void argument_type_checker(const MalType& arg) {
     }
 }
 
-static string tostr(const vector<MalType>& args, const string& sep, bool print_readably) {
-    auto r = args
-        | views::transform([=](auto&& arg) { return pr_str(arg, print_readably); });
-    vector<string> strs(r.begin(), r.end());
+// Prints args into a buffer which is reused from call to call, so prn and
+// println in a loop don't allocate once it has grown big enough.
+static const string& tostr(span<const MalType> args, string_view sep, bool print_readably) {
+    static string buf;
 
-    string ret;
+    buf.clear();
+    pr_str(buf, args, sep, print_readably);
 
-    for (size_t i = 0; i < strs.size(); ++i) {
-        ret += strs[i];
-        if (i + 1 != strs.size()) {
-            ret += sep;
-        }
-    }
-
-    return ret;
+    return buf;
 }
-
 static shared_ptr<MalList> vec2ls(shared_ptr<MalVector> vec) {
     auto ls = make_shared<MalList>();
     ls->data = MalList::T(vec->data.begin(), vec->data.end());
     return ls;
 }
 
-static MalType mal_plus(const vector<MalType>& args) {
+static MalType mal_plus(span<const MalType> args) {
     auto int_args = args
         | views::transform(arg_transformer<MalNumber>)
         | views::transform([](auto arg) { return arg.data; });
     return MalNumber(accumulate(int_args.begin(), int_args.end(), 0));
 }
 
-static MalType mal_minus(const vector<MalType>& args) {
+static MalType mal_minus(span<const MalType> args) {
     auto int_args = args
         | views::transform(arg_transformer<MalNumber>)
         | views::transform([](auto arg) { return arg.data; });
@@ -77,14 +71,14 @@ static MalType mal_minus(const vector<MalType>& args) {
     return MalNumber(vec[0] - accumulate(vec.begin() + 1, vec.end(), 0));
 }
 
-static MalType mal_multiply(const vector<MalType>& args) {
+static MalType mal_multiply(span<const MalType> args) {
     auto int_args = args
         | views::transform(arg_transformer<MalNumber>)
         | views::transform([](auto arg) { return arg.data; });
     return MalNumber(accumulate(int_args.begin(), int_args.end(), 1, multiplies<>()));
 }
 
-static MalType mal_divide(const vector<MalType>& args) {
+static MalType mal_divide(span<const MalType> args) {
     auto int_args = args
         | views::transform(arg_transformer<MalNumber>)
         | views::transform([](auto arg) { return arg.data; });
@@ -98,16 +92,16 @@ static MalType mal_divide(const vector<MalType>& args) {
     return MalNumber(vec[0] / accumulate(vec.begin() + 1, vec.end(), 1, multiplies<>()));
 }
 
-static MalType mal_list(const vector<MalType>& args) {
-    return make_shared<MalList>(list<MalType>(args.begin(), args.end()));
+static MalType mal_list(span<const MalType> args) {
+    return make_shared<MalList>(MalList::T(args.begin(), args.end()));
 }
 
-static MalType mal_is_list(const vector<MalType>& args) {
+static MalType mal_is_list(span<const MalType> args) {
     argument_count_checker(args, 1);
     return MalBool(holds_alternative<shared_ptr<MalList>>(args.front()));
 }
 
-static MalType mal_is_empty(const vector<MalType>& args) {
+static MalType mal_is_empty(span<const MalType> args) {
     argument_count_checker(args, 1);
 
     return MalBool(visit([](auto&& v) -> bool {
@@ -124,7 +118,7 @@ static MalType mal_is_empty(const vector<MalType>& args) {
     }, args.front()));
 }
 
-static MalType mal_count(const vector<MalType>& args) {
+static MalType mal_count(span<const MalType> args) {
     argument_count_checker(args, 1);
 
     return MalNumber(visit([](auto&& v) -> int {
@@ -191,6 +185,8 @@ static bool _equal(const MalType& _a, const MalType& _b) {
             return a.get() == b.get();
         } else if constexpr (is_all_same_v<T, U, shared_ptr<MalAtom>>) {
             return _equal(a->data, b->data);
+        } else if constexpr (is_all_same_v<T, U, MalSymbol>) {
+            return a.id == b.id;
         } else if constexpr (is_all_same_v<T, U>) {
             return a.data == b.data;
         }
@@ -198,7 +194,7 @@ static bool _equal(const MalType& _a, const MalType& _b) {
     }, x, y);
 }
 
-static MalType mal_equal_value(const vector<MalType>& args) {
+static MalType mal_equal_value(span<const MalType> args) {
     if (args.empty()) return MalBool(true);
 
     for (auto it = args.begin() + 1; it != args.end(); ++it) {
@@ -210,7 +206,7 @@ static MalType mal_equal_value(const vector<MalType>& args) {
     return MalBool(true);
 }
 
-static MalType mal_equal(const vector<MalType>& args) {
+static MalType mal_equal(span<const MalType> args) {
     if (args.empty()) return MalBool(true);
 
     for (auto it = args.begin() + 1; it != args.end(); ++it) {
@@ -234,7 +230,7 @@ static MalType mal_equal(const vector<MalType>& args) {
     return MalBool(true);
 }
 
-static MalType mal_less(const vector<MalType>& args) {
+static MalType mal_less(span<const MalType> args) {
     auto nums = args
         | views::transform(arg_transformer<MalNumber>)
         | views::transform([](auto arg) { return arg.data; });
@@ -243,7 +239,7 @@ static MalType mal_less(const vector<MalType>& args) {
         greater_equal<>()) == nums.end());
 }
 
-static MalType mal_less_equal(const vector<MalType>& args) {
+static MalType mal_less_equal(span<const MalType> args) {
     auto nums = args
         | views::transform(arg_transformer<MalNumber>)
         | views::transform([](auto arg) { return arg.data; });
@@ -252,7 +248,7 @@ static MalType mal_less_equal(const vector<MalType>& args) {
         greater<>()) == nums.end());
 }
 
-static MalType mal_greater(const vector<MalType>& args) {
+static MalType mal_greater(span<const MalType> args) {
     auto nums = args
         | views::transform(arg_transformer<MalNumber>)
         | views::transform([](auto arg) { return arg.data; });
@@ -261,7 +257,7 @@ static MalType mal_greater(const vector<MalType>& args) {
         less_equal<>()) == nums.end());
 }
 
-static MalType mal_greater_equal(const vector<MalType>& args) {
+static MalType mal_greater_equal(span<const MalType> args) {
     auto nums = args
         | views::transform(arg_transformer<MalNumber>)
         | views::transform([](auto arg) { return arg.data; });
@@ -270,32 +266,32 @@ static MalType mal_greater_equal(const vector<MalType>& args) {
         less<>()) == nums.end());
 }
 
-static MalType mal_pr_str(const vector<MalType>& args) {
+static MalType mal_pr_str(span<const MalType> args) {
     return MalString(tostr(args, " ", true));
 }
 
-static MalType mal_str(const vector<MalType>& args) {
+static MalType mal_str(span<const MalType> args) {
     return MalString(tostr(args, "", false));
 }
 
-static MalType mal_prn(const vector<MalType>& args) {
+static MalType mal_prn(span<const MalType> args) {
     cout << tostr(args, " ", true) << endl;
     return MalNil();
 }
 
-static MalType mal_println(const vector<MalType>& args) {
+static MalType mal_println(span<const MalType> args) {
     cout << tostr(args, " ", false) << endl;
     return MalNil();
 }
 
-static MalType mal_read_string(const vector<MalType>& args) {
+static MalType mal_read_string(span<const MalType> args) {
     argument_count_checker(args, 1);
     return read_str(get<MalString>(args[0]).data);
 }
 
-static MalType mal_slurp(const vector<MalType>& args) {
+static MalType mal_slurp(span<const MalType> args) {
     argument_count_checker(args, 1);
-    auto& path = get<MalString>(args[0]).data;
+    const string& path = get<MalString>(args[0]).data;
     
     ifstream file(path);
 
@@ -309,80 +305,164 @@ static MalType mal_slurp(const vector<MalType>& args) {
     return MalString(std::move(str));
 }
 
-static MalType mal_eval(const vector<MalType>& args) {
+// Evaluates the forms of a file as they are read, rather than reading the
+// whole file into one (do ...) form first.
+static MalType mal_load_file(span<const MalType> args) {
+    argument_count_checker(args, 1);
+    const string& path = get<MalString>(args[0]).data;
+
+    ifstream file(path);
+
+    if (!file) {
+        throw MalRuntimeError("can't open file '" + path + "'");
+    }
+
+    FormReader reader(file);
+    while (auto form = reader.next()) {
+        eval(*form, repl_env);
+    }
+
+    return MalNil();
+}
+
+static MalType mal_eval(span<const MalType> args) {
     argument_count_checker(args, 1);
     return eval(args[0], repl_env);
 }
 
-static MalType mal_atom(const vector<MalType>& args) {
+static MalType mal_atom(span<const MalType> args) {
     argument_count_checker(args, 1);
     return make_shared<MalAtom>(args.front());
 }
 
-static MalType mal_is_atom(const vector<MalType>& args) {
+static MalType mal_is_atom(span<const MalType> args) {
     argument_count_checker(args, 1);
     return MalBool(holds_alternative<shared_ptr<MalAtom>>(args.front()));
 }
 
-static MalType mal_deref(const vector<MalType>& args) {
+static MalType mal_deref(span<const MalType> args) {
     argument_count_checker(args, 1);
     return arg_transformer<shared_ptr<MalAtom>>(args.front())->data;
 }
 
-static MalType mal_reset(const vector<MalType>& args) {
+static MalType mal_reset(span<const MalType> args) {
     argument_count_checker(args, 2);
     return arg_transformer<shared_ptr<MalAtom>>(args.front())->data = args[1];
 }
 
-static MalType mal_swap(const vector<MalType>& args) {
+static MalType mal_swap(span<const MalType> args) {
     if (args.size() < 2) {
         throw MalRuntimeError("invalid argument count:" + to_string(args.size()));
     }
 
     auto atom = arg_transformer<shared_ptr<MalAtom>>(args[0]);
     auto fn = arg_transformer<shared_ptr<MalFunction>>(args[1]);
-    auto ls = make_shared<MalList>();
+    vector<MalType> fn_args;
 
-    ls->data.push_back(fn);
-    ls->data.push_back(atom->data);
-    ls->data.insert(ls->data.end(), args.begin() + 2, args.end());
+    fn_args.reserve(args.size() - 1);
+    fn_args.push_back(atom->data);
+    fn_args.insert(fn_args.end(), args.begin() + 2, args.end());
 
-    return atom->data = eval(ls, repl_env);
+    return atom->data = call(*fn, fn_args);
 }
 
-static MalType mal_cons(const vector<MalType>& args) {
-    argument_count_checker(args, 2);
-    
+static MalType mal_apply(span<const MalType> args) {
+    if (args.size() < 2) {
+        throw MalRuntimeError("invalid argument count: " + to_string(args.size()));
+    }
+
+    auto fn = arg_transformer<shared_ptr<MalFunction>>(args.front());
+    auto middle = args.subspan(1, args.size() - 2);
+
     return visit([&](auto&& v) -> MalType {
         using T = decay_t<decltype(v)>;
 
+        // A vector's items can be passed as they are, unless other
+        // arguments come before them.
+        if constexpr (is_same_v<T, shared_ptr<MalVector>>) {
+            if (middle.empty()) return call(*fn, v->data);
+        }
+        if constexpr (is_same_v<T, shared_ptr<MalList>>
+                || is_same_v<T, shared_ptr<MalVector>>) {
+            vector<MalType> fn_args(middle.begin(), middle.end());
+            fn_args.insert(fn_args.end(), v->data.begin(), v->data.end());
+            return call(*fn, fn_args);
+        }
+        if constexpr (is_same_v<T, MalNil>)
+            return call(*fn, middle);
+
+        throw MalRuntimeError("invalid argument type: " + MalTypeToString(v));
+    }, args.back());
+}
+
+static MalType mal_map(span<const MalType> args) {
+    argument_count_checker(args, 2);
+
+    auto fn = arg_transformer<shared_ptr<MalFunction>>(args.front());
+    vector<MalType> ret;
+
+    visit([&](auto&& v) {
+        using T = decay_t<decltype(v)>;
+
         if constexpr (is_same_v<T, shared_ptr<MalList>>
                 || is_same_v<T, shared_ptr<MalVector>>) {
-            MalList::T ls;
+            for (auto& item: v->data) {
+                ret.push_back(call(*fn, span(&item, 1)));
+            }
+        } else if constexpr (!is_same_v<T, MalNil>) {
+            throw MalRuntimeError("invalid argument type: " + MalTypeToString(v));
+        }
+    }, args[1]);
+
+    return make_shared<MalList>(MalList::T(ret.begin(), ret.end()));
+}
+
+static MalType mal_cons(span<const MalType> args) {
+    argument_count_checker(args, 2);
+    
+    return visit([&](auto&& v) -> MalType {
+        using T = decay_t<decltype(v)>;
+
+        if constexpr (is_same_v<T, shared_ptr<MalList>>) {
+            return make_shared<MalList>(v->data.cons(args[0]));
+        }
+        if constexpr (is_same_v<T, shared_ptr<MalVector>>) {
+            vector<MalType> ls;
+            ls.reserve(v->data.size() + 1);
             ls.push_back(args[0]);
             ls.insert(ls.end(), v->data.begin(), v->data.end());
-            return make_shared<MalList>(std::move(ls));
+            return make_shared<MalList>(MalList::T(std::move(ls)));
         }
 
         throw MalRuntimeError("invalid argument type: " + MalTypeToString(v));
     }, args[1]);
 }
 
-static MalType mal_concat(const vector<MalType>& args) {
+static MalType mal_concat(span<const MalType> args) {
+    // The result shares the last argument's elements when it is a list,
+    // so only the elements in front of it are copied.
     MalList::T ls;
 
-    for (auto& arg: args) {
+    for (auto arg = args.rbegin(); arg != args.rend(); ++arg) {
         visit([&](auto&& v) {
             using T = decay_t<decltype(v)>;
 
+            if constexpr (is_same_v<T, shared_ptr<MalList>>) {
+                if (arg == args.rbegin()) {
+                    ls = v->data;
+                    return;
+                }
+            }
             if constexpr (is_same_v<T, shared_ptr<MalList>>
                     || is_same_v<T, shared_ptr<MalVector>>) {
-                ls.insert(ls.end(), v->data.begin(), v->data.end());
+                for (auto it = v->data.rbegin(); it != v->data.rend(); ++it) {
+                    ls = ls.cons(*it);
+                }
                 return;
             }
 
             throw MalRuntimeError("invalid argument type: " + MalTypeToString(v));
-        }, arg);
+        }, *arg);
     }
 
     return make_shared<MalList>(std::move(ls));
@@ -397,8 +477,7 @@ static optional<MalType> unbox_unquote(const MalType& ast) {
     if (!holds_alternative<MalSymbol>(ls->data.front())) {
         return nullopt;
     }
-    auto sym = get<MalSymbol>(ls->data.front());
-    if (sym.data != "unquote") return nullopt;
+    if (get<MalSymbol>(ls->data.front()).id != SYM_UNQUOTE) return nullopt;
     if (ls->data.size() != 2) {
         throw MalEvalFailed(ls, "invalid unquote form");
     }
@@ -414,8 +493,7 @@ static optional<MalType> unbox_splice_unquote(const MalType& ast) {
     if (!holds_alternative<MalSymbol>(ls->data.front())) {
         return nullopt;
     }
-    auto sym = get<MalSymbol>(ls->data.front());
-    if (sym.data != "splice-unquote") return nullopt;
+    if (get<MalSymbol>(ls->data.front()).id != SYM_SPLICE_UNQUOTE) return nullopt;
     if (ls->data.size() != 2) {
         throw MalEvalFailed(ls, "invalid splice-unquote form");
     }
@@ -435,17 +513,17 @@ static MalType _quasiquote(const MalType& ast, bool unquote = true) {
 
         for (auto rit = ls.rbegin(); rit != ls.rend(); ++rit) {
             if (auto opt = unbox_splice_unquote(*rit)) {
-                MalList::T tmp;
-                tmp.push_back(MalSymbol("concat"));
-                tmp.push_back(*opt);
-                tmp.push_back(make_shared<MalList>(std::move(res)));
-                res = std::move(tmp);
+                res = MalList::T{
+                    MalSymbol("concat"),
+                    *opt,
+                    make_shared<MalList>(std::move(res)),
+                };
             } else {
-                MalList::T tmp;
-                tmp.push_back(MalSymbol("cons"));
-                tmp.push_back(_quasiquote(*rit));
-                tmp.push_back(make_shared<MalList>(std::move(res)));
-                res = std::move(tmp);
+                res = MalList::T{
+                    MalSymbol("cons"),
+                    _quasiquote(*rit),
+                    make_shared<MalList>(std::move(res)),
+                };
             }
         }
 
@@ -454,28 +532,29 @@ static MalType _quasiquote(const MalType& ast, bool unquote = true) {
 
     if (holds_alternative<shared_ptr<MalHashmap>>(ast)
             || holds_alternative<MalSymbol>(ast)) {
-        auto ls = make_shared<MalList>();
-        ls->data.push_back(MalSymbol("quote"));
-        ls->data.push_back(ast);
-        return ls;
+        return make_shared<MalList>(MalList::T{ MalSymbol("quote"), ast });
     }
 
     if (holds_alternative<sptr<MalVector>>(ast)) {
-        MalList::T res;
-        res.push_back(MalSymbol("vec"));
-        res.push_back(_quasiquote(vec2ls(get<sptr<MalVector>>(ast)), false));
-        return make_shared<MalList>(std::move(res));
+        return make_shared<MalList>(MalList::T{
+            MalSymbol("vec"),
+            _quasiquote(vec2ls(get<sptr<MalVector>>(ast)), false),
+        });
     }
 
     return ast;
 }
 
-static MalType mal_quasiquote(const vector<MalType>& args) {
+MalType quasiquote(const MalType& ast) {
+    return _quasiquote(ast);
+}
+
+static MalType mal_quasiquote(span<const MalType> args) {
     argument_count_checker(args, 1);
     return _quasiquote(args.front());
 }
 
-static MalType mal_vec(const vector<MalType>& args) {
+static MalType mal_vec(span<const MalType> args) {
     argument_count_checker(args, 1);
 
     return visit([&](auto&& v) -> MalType {
@@ -491,6 +570,74 @@ static MalType mal_vec(const vector<MalType>& args) {
     }, args.front());
 }
 
+static MalType mal_nth(span<const MalType> args) {
+    argument_count_checker(args, 2);
+    auto n = arg_transformer<MalNumber>(args[1]).data;
+
+    return visit([&](auto&& v) -> MalType {
+        using T = decay_t<decltype(v)>;
+
+        if constexpr (is_same_v<T, shared_ptr<MalList>>
+                || is_same_v<T, shared_ptr<MalVector>>) {
+            if (n < 0 || static_cast<size_t>(n) >= v->data.size()) {
+                throw MalRuntimeError("index out of range: " + to_string(n));
+            }
+            return *next(v->data.begin(), n);
+        }
+
+        throw MalRuntimeError("invalid argument type: " + MalTypeToString(v));
+    }, args[0]);
+}
+
+static MalType mal_first(span<const MalType> args) {
+    argument_count_checker(args, 1);
+
+    return visit([&](auto&& v) -> MalType {
+        using T = decay_t<decltype(v)>;
+
+        if constexpr (is_same_v<T, shared_ptr<MalList>>
+                || is_same_v<T, shared_ptr<MalVector>>) {
+            if (v->data.empty()) return MalNil();
+            return v->data.front();
+        }
+        if constexpr (is_same_v<T, MalNil>)
+            return MalNil();
+
+        throw MalRuntimeError("invalid argument type: " + MalTypeToString(v));
+    }, args.front());
+}
+
+static MalType mal_rest(span<const MalType> args) {
+    argument_count_checker(args, 1);
+
+    return visit([&](auto&& v) -> MalType {
+        using T = decay_t<decltype(v)>;
+
+        if constexpr (is_same_v<T, shared_ptr<MalList>>
+                || is_same_v<T, shared_ptr<MalVector>>) {
+            if (v->data.empty()) return make_shared<MalList>();
+            if constexpr (is_same_v<T, shared_ptr<MalList>>)
+                return make_shared<MalList>(v->data.rest());
+            else
+                return make_shared<MalList>(MalList::T(next(v->data.begin()), v->data.end()));
+        }
+        if constexpr (is_same_v<T, MalNil>)
+            return make_shared<MalList>();
+
+        throw MalRuntimeError("invalid argument type: " + MalTypeToString(v));
+    }, args.front());
+}
+
+static MalType mal_time_ms(span<const MalType> args) {
+    argument_count_checker(args, 0);
+
+    using namespace chrono;
+    auto ms = duration_cast<milliseconds>(
+        steady_clock::now().time_since_epoch());
+
+    return MalNumber(static_cast<MalNumber::T>(ms.count()));
+}
+
 unordered_map<string, MalFunction> core_fn{
     { "+", MalFunction(mal_plus) },
     { "-", MalFunction(mal_minus) },
@@ -512,15 +659,22 @@ unordered_map<string, MalFunction> core_fn{
     { "println", MalFunction(mal_println) },
     { "read-string", MalFunction(mal_read_string) },
     { "slurp", MalFunction(mal_slurp) },
+    { "load-file", MalFunction(mal_load_file) },
     { "eval", MalFunction(mal_eval) },
     { "atom", MalFunction(mal_atom) },
     { "atom?", MalFunction(mal_is_atom) },
     { "deref", MalFunction(mal_deref) },
     { "reset!", MalFunction(mal_reset) },
     { "swap!", MalFunction(mal_swap) },
+    { "apply", MalFunction(mal_apply) },
+    { "map", MalFunction(mal_map) },
     { "cons", MalFunction(mal_cons) },
     { "concat", MalFunction(mal_concat) },
     { "quasiquote", MalFunction(mal_quasiquote) },
     { "vec", MalFunction(mal_vec) },
+    { "nth", MalFunction(mal_nth) },
+    { "first", MalFunction(mal_first) },
+    { "rest", MalFunction(mal_rest) },
+    { "time-ms", MalFunction(mal_time_ms) },
 };
 
@@ -14,3 +14,6 @@ public:
 };
 
 extern std::unordered_map<std::string, MalFunction> core_fn;
+
+// The form which (quasiquote ast) evaluates as.
+MalType quasiquote(const MalType& ast);
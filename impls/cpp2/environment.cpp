@@ -2,7 +2,6 @@
 
 using namespace std;
 
-shared_ptr<MalEnv> repl_env( new MalEnv(
-    nullptr, {
+shared_ptr<MalEnv> repl_env( new MalEnv({
     { "DEBUG-EVAL", MalBool(false) },
 }));
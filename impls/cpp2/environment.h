@@ -5,53 +5,110 @@
 #include <memory>
 #include <unordered_map>
 #include <optional>
-#include <cassert>
-#include "ranges_extension.h"
+#include <initializer_list>
 
 #include "types.h"
 
+//
+// A frame of the environment.
+//
+// Frames made by fn* calls and let* hold their variables in m_slots, in
+// the order given by the form's layout, so resolved symbols are found by
+// (depth, slot) without looking at names. The global frame, and def! of
+// a name a local frame has no slot for, use the m_vars hash table.
+//
 class MalEnv {
 private:
     using Outer = std::shared_ptr<MalEnv>;
-    using Hashmap = std::unordered_map<std::string, MalType>;
+    using Id = MalSymbol::Id;
+    using Layout = MalList::Layout;
+    using Hashmap = std::unordered_map<Id, MalType>;
 
 public:
-    MalEnv(Outer outer = nullptr, Hashmap hashmap = {})
-        : m_outer(std::move(outer)), m_hashmap(std::move(hashmap))
-    { }
+    MalEnv(std::initializer_list<std::pair<std::string, MalType>> vars = {})
+        : m_globals(this)
+    {
+        for (auto& [k, v]: vars) {
+            set(k, v);
+        }
+    }
 
-    template <typename T, typename U>
-    MalEnv(Outer outer, T&& binds, U&& exprs)
-        : m_outer(std::move(outer)), m_hashmap()
+    MalEnv(Outer outer, std::shared_ptr<const Layout> layout)
+        : m_outer(std::move(outer))
+        , m_globals(m_outer->m_globals)
+        , m_layout(std::move(layout))
     {
-        auto itk = binds.begin();
-        auto itv = exprs.begin();
-
-        while (itk != binds.end()) {
-            if (*itk == "&") {
-                auto ls = std::make_shared<MalList>();
-                ls->data = MalList::T(itv, exprs.end());
-                m_hashmap[*++itk] = ls;
-                break;
+        m_slots.reserve(m_layout->size());
+    }
+
+    // Fills the next slot of the layout.
+    void bind(MalType v) {
+        m_slots.push_back(std::move(v));
+    }
+
+    void set(const std::string& k, MalType v) {
+        set(MalSymbol::intern(k), std::move(v));
+    }
+
+    void set(Id id, MalType v) {
+        if (auto slot = find_slot(id)) {
+            *slot = std::move(v);
+        } else {
+            m_vars[id] = std::move(v);
+        }
+    }
+
+    std::optional<MalType> get(const std::string& k) const {
+        return get(MalSymbol::intern(k));
+    }
+
+    std::optional<MalType> get(Id id) const {
+        for (auto env = this; env; env = env->m_outer.get()) {
+            if (auto slot = env->find_slot(id)) {
+                return *slot;
+            }
+            if (auto it = env->m_vars.find(id); it != env->m_vars.end()) {
+                return it->second;
             }
-            m_hashmap[*itk++] = *itv++;
         }
+        return std::nullopt;
     }
 
-    void set(std::string k, MalType v) {
-        m_hashmap[std::move(k)] = std::move(v);
+    const MalType* get_local(unsigned depth, unsigned slot) const {
+        auto env = this;
+        while (depth--) {
+            env = env->m_outer.get();
+        }
+        return slot < env->m_slots.size() ? &env->m_slots[slot] : nullptr;
     }
 
-    std::optional<MalType> get(const std::string k) const {
-        auto it = m_hashmap.find(k);
-        if (it != m_hashmap.end())
-            return it->second;
-        return (m_outer ? m_outer->get(k) : std::nullopt);
+    const MalType* get_global(Id id) const {
+        auto it = m_globals->m_vars.find(id);
+        return it != m_globals->m_vars.end() ? &it->second : nullptr;
     }
 
+    // For the resolver, which walks the frames of a closure's environment.
+    const Outer& outer() const { return m_outer; }
+    const std::shared_ptr<const Layout>& layout() const { return m_layout; }
+    const Hashmap& vars() const { return m_vars; }
+
 private:
+    const MalType* find_slot(Id id) const {
+        for (auto i = m_slots.size(); i--;) {
+            if ((*m_layout)[i] == id) return &m_slots[i];
+        }
+        return nullptr;
+    }
+
+    MalType* find_slot(Id id) {
+        return const_cast<MalType*>(std::as_const(*this).find_slot(id));
+    }
+
     Outer m_outer;
-    Hashmap m_hashmap;
+    MalEnv* m_globals;
+    std::shared_ptr<const Layout> m_layout;
+    std::vector<MalType> m_slots;
+    Hashmap m_vars;
 };
 
 extern std::shared_ptr<MalEnv> repl_env;
@@ -1,10 +1,10 @@
 #include <ranges>
-#include <map>
-#include <cassert>
 #include <iostream>
 
 #include "eval.h"
+#include "core.h"
 #include "util.h"
+#include "resolver.h"
 
 using namespace std;
 using namespace ranges;
@@ -14,10 +14,47 @@ struct TCO {
     shared_ptr<MalEnv> env;
 };
 
-static MalType apply(const MalList& ls);
+// What a special form or a call hands back to eval(): either the final
+// value, or the (ast, env) pair to continue with in eval()'s loop.
+using EvalResult = variant<MalType, TCO>;
+
+static EvalResult apply_fn(const MalType& fn, span<const MalType> args);
+
+static MalType resolve(EvalResult r) {
+    if (auto tco = get_if<TCO>(&r)) {
+        return eval(tco->ast, tco->env);
+    }
+    return std::move(get<MalType>(r));
+}
+
+template <typename It>
+static EvalResult eval_body(It it, It last, shared_ptr<MalEnv> env) {
+    if (it == last) return MalNil();
+
+    while (std::next(it) != last) {
+        eval(*it++, env);
+    }
+
+    return TCO{ *it, env };
+}
+
+static EvalResult apply_closure(const MalClosure& closure, span<const MalType> args) {
+    auto fn_env = make_shared<MalEnv>(closure.env, closure.layout);
+    auto fixed = closure.fixed;
+
+    for (size_t i = 0; i < fixed && i < args.size(); ++i) {
+        fn_env->bind(args[i]);
+    }
+    if (closure.variadic && args.size() >= fixed) {
+        fn_env->bind(make_shared<MalList>(MalList::T(args.begin() + fixed, args.end())));
+    }
+
+    return eval_body(closure.body->begin(), closure.body->end(), fn_env);
+}
 
 static void print_debug_eval_if_activated(const MalType& ast, const MalEnv& env) {
-    auto opt = env.get("DEBUG-EVAL");
+    static const auto debug_eval = MalSymbol::intern("DEBUG-EVAL");
+    auto opt = env.get(debug_eval);
 
     if (!opt) return;
 
@@ -36,87 +73,59 @@ static void print_debug_eval_if_activated(const MalType& ast, const MalEnv& env)
 }
 
 static MalType def_if_valid(const MalType& k, const MalType& v, shared_ptr<MalEnv> env) {
-    auto var_name = echanger(
+    auto var_id = echanger(
         [&]() { return get<MalSymbol>(k); },
         [&]() { return MalEvalFailed(k, "not a symbol"); }
-    ).data;
+    ).id;
     auto value = eval(v, env);
 
-    env->set(std::move(var_name), value);
+    env->set(var_id, value);
 
     return value;
 }
 
-template <typename T>
-static void let_def(T&& cont, shared_ptr<MalEnv> env) {
-    assert(cont.size() % 2 == 0);
-    for (auto&& chunk: cont | views::chunk(2)) {
-        def_if_valid(*chunk.begin(), *++chunk.begin(), env);
-    }
-}
-
-static MalType core_form_def(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
+static EvalResult core_form_def(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
     if (ls->data.size() != 3) {
         throw MalEvalFailed(ls, "invalid def! form");
     }
-    auto it = ls->data.begin();
-    assert(get<MalSymbol>(*it++).data == "def!");
+    auto it = std::next(ls->data.begin());
     auto var_name_it = it++;
     auto expr_it = it;
 
     return def_if_valid(*var_name_it, *expr_it, env);
 }
 
-static MalType core_form_let(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
-    if (ls->data.size() < 2) {
-        throw MalEvalFailed(ls, "invalid let* form");
-    }
-    auto it = ls->data.begin();
-    assert(get<MalSymbol>(*it++).data == "let*");
-
-    auto let_env = make_shared<MalEnv>(env);
-
-    visit([&](auto&& cont) {
-        using T = decay_t<decltype(cont)>;
-        if constexpr (is_same_v<T, shared_ptr<MalList>>
-                || is_same_v<T, shared_ptr<MalVector>>) {
-            if (cont->data.size() % 2) {
-                throw MalEvalFailed(ls, "invalid let* def count");
-            }
-            let_def(cont->data, let_env);
-            return;
+static EvalResult core_form_let(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
+    if (!ls->layout) {
+        auto resolved = resolve_form(ls, env);
+        if (!resolved) {
+            throw MalEvalFailed(ls, "invalid let* form");
         }
-        throw MalEvalFailed(ls, "invalid let* form");
-    }, *it++);
+        ls = std::move(resolved);
+    }
+    auto it = std::next(ls->data.begin());
 
-    if (it == ls->data.end()) return MalNil();
+    auto let_env = make_shared<MalEnv>(env, ls->layout);
+    auto& bindings = get<shared_ptr<MalVector>>(*it++)->data;
 
-    while (std::next(it) != ls->data.end()) {
-        eval(*it++, let_env);
+    for (size_t i = 1; i < bindings.size(); i += 2) {
+        let_env->bind(eval(bindings[i], let_env));
     }
 
-    throw TCO{ *it, let_env };
+    return eval_body(it, ls->data.end(), let_env);
 }
 
-static MalType core_form_do(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
-    auto it = ls->data.begin();
-    assert(get<MalSymbol>(*it++).data == "do");
-
-    if (it == ls->data.end()) return MalNil();
-
-    while (std::next(it) != ls->data.end()) {
-        eval(*it++, env);
-    }
+static EvalResult core_form_do(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
+    auto it = std::next(ls->data.begin());
 
-    throw TCO{ *it , env };
+    return eval_body(it, ls->data.end(), env);
 }
 
-static MalType core_form_if(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
+static EvalResult core_form_if(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
     if (ls->data.size() != 3 && ls->data.size() != 4) {
         throw MalEvalFailed(ls, "invalid if form");
     }
-    auto it = ls->data.begin();
-    assert(get<MalSymbol>(*it++).data == "if");
+    auto it = std::next(ls->data.begin());
 
     auto cond_tmp = eval(*it++, env);
     bool cond = visit([](auto&& v) {
@@ -129,122 +138,127 @@ static MalType core_form_if(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
     }, cond_tmp);
 
     if (cond) {
-        throw TCO{ *it, env };
+        return TCO{ *it, env };
     } else if (ls->data.size() == 4) {
-        throw TCO{ *++it, env };
+        return TCO{ *++it, env };
     } else {
         return MalNil();
     }
 }
 
-static MalType core_form_fn(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
-    if (ls->data.size() < 2) {
-        throw MalEvalFailed(ls, "invalid fn* form");
+static EvalResult core_form_fn(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
+    if (!ls->layout) {
+        auto resolved = resolve_form(ls, env);
+        if (!resolved) {
+            throw MalEvalFailed(ls, "invalid fn* form");
+        }
+        ls = std::move(resolved);
     }
-    auto it = ls->data.begin();
-    assert(get<MalSymbol>(*it++).data == "fn*");
-
-    auto param_list = visit([&](auto&& params) -> list<string> {
+    // The parameters before & take one argument each.
+    size_t fixed = 0;
+    bool variadic = visit([&](auto&& params) {
         using T = decay_t<decltype(params)>;
         if constexpr (is_same_v<T, shared_ptr<MalList>>
                 || is_same_v<T, shared_ptr<MalVector>>) {
-            list<string> param_list;
-
-            for (auto& arg_name: params->data) {
-                param_list.push_back(get<MalSymbol>(arg_name).data);
+            for (auto& param: params->data) {
+                if (get<MalSymbol>(param).name() == "&") return true;
+                ++fixed;
             }
-
-            return param_list;
-        }
-        throw MalEvalFailed(ls, "invalid fn* form");
-    }, *it++);
-
-    return make_shared<MalFunction>(
-        [=](const vector<MalType>& args) {
-            auto fn_env = make_shared<MalEnv>(env, param_list, args);
-            auto it = ls->data.begin();
-            std::advance(it, 2);
-
-            if (it == ls->data.end()) return MalNil();
-
-            while (std::next(it) != ls->data.end()) {
-                eval(*it++, fn_env);
-            }
-
-            throw TCO{ *it , fn_env };
         }
+        return false;
+    }, *std::next(ls->data.begin()));
+
+    auto closure = make_shared<MalClosure>(
+        ls->layout,
+        fixed,
+        variadic,
+        ls->body,
+        env
     );
+
+    return make_shared<MalFunction>(std::move(closure));
 }
 
-static MalType core_form_quote(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
+static EvalResult core_form_quote(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
     if (ls->data.size() != 2) {
         throw MalEvalFailed(ls, "invalid quote form");
     }
-    auto it = ls->data.begin();
-    assert(get<MalSymbol>(*it++).data == "quote");
+    auto it = std::next(ls->data.begin());
 
     return *it;
 }
 
-static MalType core_form_quasiquote(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
+static EvalResult core_form_quasiquote(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
     if (ls->data.size() != 2) {
         throw MalEvalFailed(ls, "invalid quasiquote form");
     }
-    auto it = ls->data.begin();
-    assert(get<MalSymbol>(*it++).data == "quasiquote");
-
-    auto fn = eval(MalSymbol("quasiquote"), env);
-    auto ast = apply(MalList({ fn, *it }));
+    auto it = std::next(ls->data.begin());
 
-    throw TCO{ ast, env };
+    return TCO{ quasiquote(*it), env };
 }
 
-static map<string, function<MalType(shared_ptr<MalList>, shared_ptr<MalEnv>)>> core_form = {
-    { "def!", core_form_def },
-    { "let*", core_form_let },
-    { "do", core_form_do },
-    { "if", core_form_if },
-    { "fn*", core_form_fn },
-    { "quote", core_form_quote },
-    { "quasiquote", core_form_quasiquote },
-};
-
-static MalType apply(const MalList& ls) {
-    auto it = ls.data.begin();
-    auto it_end = ls.data.end();
+static EvalResult apply_fn(const MalType& _fn, span<const MalType> args) {
     auto fn = echanger(
-        [&]() { return get<shared_ptr<MalFunction>>(*it); },
-        [&]() { return MalEvalFailed(*it, "not a function"); }
+        [&]() { return get<shared_ptr<MalFunction>>(_fn); },
+        [&]() { return MalEvalFailed(_fn, "not a function"); }
     );
-    vector<MalType> args(++it, it_end);
-    return fn->data(args);
+    if (fn->closure) {
+        return apply_closure(*fn->closure, args);
+    }
+    return fn->native(args);
+}
+
+MalType call(const MalFunction& fn, span<const MalType> args) {
+    if (fn.closure) {
+        return resolve(apply_closure(*fn.closure, args));
+    }
+    return fn.native(args);
 }
 
 static MalType eval_symbol(const MalSymbol& sym, shared_ptr<MalEnv> env) {
-    auto opt = env->get(sym.data);
-    if (!opt) {
-        throw MalEvalFailed(sym, "symbol not found");
+    switch (sym.binding) {
+        case MalSymbol::LOCAL:
+            if (auto v = env->get_local(sym.depth, sym.slot)) return *v;
+            // A closure made in a let* can run before a later binding in
+            // it is made, and sees the name's outer value until then.
+            if (auto opt = env->get(sym.id)) return *opt;
+            break;
+        case MalSymbol::GLOBAL:
+            if (auto v = env->get_global(sym.id)) return *v;
+            break;
+        case MalSymbol::DYNAMIC:
+            if (auto opt = env->get(sym.id)) return *opt;
+            break;
     }
-    return *opt;
+    throw MalEvalFailed(sym, "symbol not found");
 }
 
-static MalType eval_list(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
+static EvalResult eval_list(shared_ptr<MalList> ls, shared_ptr<MalEnv> env) {
     if (ls->data.empty()) {
         return make_shared<MalList>();
     }
 
-    if (holds_alternative<MalSymbol>(ls->data.front())) {
-        const string& s = get<MalSymbol>(ls->data.front()).data;
-        auto it = core_form.find(s);
-        if (it != core_form.end())
-            return it->second(ls, env);
+    if (auto sym = get_if<MalSymbol>(&ls->data.front())) {
+        switch (sym->id) {
+            case SYM_DEF:        return core_form_def(ls, env);
+            case SYM_LET:        return core_form_let(ls, env);
+            case SYM_DO:         return core_form_do(ls, env);
+            case SYM_IF:         return core_form_if(ls, env);
+            case SYM_FN:         return core_form_fn(ls, env);
+            case SYM_QUOTE:      return core_form_quote(ls, env);
+            case SYM_QUASIQUOTE: return core_form_quasiquote(ls, env);
+        }
     }
 
-    auto r = ls->data
-        | views::transform([&](auto&& expr) { return eval(expr, env); });
-    auto ret = MalList();
-    ret.data = MalList::T(r.begin(), r.end());
-    return apply(ret);
+    auto fn = eval(ls->data.front(), env);
+    vector<MalType> args;
+
+    args.reserve(ls->data.size() - 1);
+    for (auto& expr: ls->data.rest()) {
+        args.push_back(eval(expr, env));
+    }
+
+    return apply_fn(fn, args);
 }
 
 static MalType eval_vector(const shared_ptr<MalVector>& vec, shared_ptr<MalEnv> env) {
@@ -271,26 +285,29 @@ MalType eval(const MalType& ast, shared_ptr<MalEnv> env) {
     while (true) {
         print_debug_eval_if_activated(_ast, *env);
 
-        try {
-            return visit([&](auto&& v) -> MalType {
-                using T = decay_t<decltype(v)>;
-                if constexpr (is_same_v<T, MalSymbol>) {
-                    return eval_symbol(v, env);
-                }
-                if constexpr (is_same_v<T, shared_ptr<MalList>>) {
-                    return eval_list(v, env);
-                }
-                if constexpr (is_same_v<T, shared_ptr<MalVector>>) {
-                    return eval_vector(v, env);
-                }
-                if constexpr (is_same_v<T, shared_ptr<MalHashmap>>) {
-                    return eval_hashmap(v, env);
-                }
-                return v;
-            }, _ast);
-        } catch (TCO& tco) {
-            _ast = tco.ast;
-            env = tco.env;
+        auto r = visit([&](auto&& v) -> EvalResult {
+            using T = decay_t<decltype(v)>;
+            if constexpr (is_same_v<T, MalSymbol>) {
+                return eval_symbol(v, env);
+            }
+            if constexpr (is_same_v<T, shared_ptr<MalList>>) {
+                return eval_list(v, env);
+            }
+            if constexpr (is_same_v<T, shared_ptr<MalVector>>) {
+                return eval_vector(v, env);
+            }
+            if constexpr (is_same_v<T, shared_ptr<MalHashmap>>) {
+                return eval_hashmap(v, env);
+            }
+            return v;
+        }, _ast);
+
+        if (auto tco = get_if<TCO>(&r)) {
+            _ast = std::move(tco->ast);
+            env = std::move(tco->env);
+            continue;
         }
+
+        return std::move(get<MalType>(r));
     }
 }
@@ -1,6 +1,7 @@
 #ifndef _MY_EVAL_H_
 #define _MY_EVAL_H_
 
+#include <span>
 #include <stdexcept>
 
 #include "environment.h"
@@ -14,8 +15,23 @@ public:
     { }
 };
 
+// A function made by fn*, taken apart once when it is made: a call binds
+// the arguments to the first slots of a frame with the fn* form's layout
+// (see resolver.h), then runs the body forms, the last as a tail call.
+struct MalClosure {
+    std::shared_ptr<const MalList::Layout> layout;
+    std::size_t fixed;           // slots taking one argument each
+    bool variadic;               // the next slot takes the rest as a list
+    std::shared_ptr<const std::vector<MalType>> body;
+    std::shared_ptr<MalEnv> env;
+};
 
 MalType eval(const MalType& ast, std::shared_ptr<MalEnv> env);
 
+// Calls a function of either kind with args, for builtins which take
+// functions. The arguments go straight to the function, without being
+// evaluated, and a closure's tail calls run in eval()'s loop as usual.
+MalType call(const MalFunction& fn, std::span<const MalType> args);
+
 
 #endif // _MY_EVAL_H_
@@ -1,124 +1,115 @@
-#include <regex>
 #include <iostream>
+#include <charconv>
 
 #include "printer.h"
-#include "util.h"
+#include "../cpp-common/escape.h"
 
 using namespace std;
 
-static string encode_string(const string& s) {
-    return regex_replace_callback(s, regex("[\\\\\n\t\r\b\"]"),
-        [] (const smatch& m) -> string {
-            switch (m.str()[0]) {
-                case '\\': return R"(\\)";
-                case '\n': return R"(\n)";
-                case '\t': return R"(\t)";
-                case '\r': return R"(\r)";
-                case '\b': return R"(\b)";
-                case '"':  return R"(\")";
-            }
-            return "";
-        });
-}
-
-static string pr_list(const MalList& l, bool print_readably) {
-    const auto& e = l.data;
-    string ret = "(";
-
-    for (auto it = e.begin(); it != e.end();) {
-        ret += pr_str(*it, print_readably);
-        if (++it == e.end()) {
-            break;
+static void pr_list(string& out, const MalList& l, bool print_readably) {
+    out += '(';
+    for (auto it = l.data.begin(); it != l.data.end(); ++it) {
+        if (it != l.data.begin()) {
+            out += ' ';
         }
-        ret += ' ';
+        pr_str(out, *it, print_readably);
     }
-
-    return ret + ")";
+    out += ')';
 }
 
-static string pr_vector(const MalVector& v, bool print_readably) {
-    const auto& e = v.data;
-    string ret = "[";
-
-    for (size_t i = 0; i < e.size(); ++i) {
-        ret += pr_str(e[i], print_readably);
-        if (i + 1 != e.size()) {
-            ret += ' ';
-        }
-    }
-
-    return ret + "]";
+static void pr_vector(string& out, const MalVector& v, bool print_readably) {
+    out += '[';
+    pr_str(out, v.data, " ", print_readably);
+    out += ']';
 }
 
-static string pr_hashmap(const MalHashmap& v, bool print_readably) {
-    const auto& e = v.data;
-    string ret = "{";
-
-    for (auto it = e.begin(); it != e.end();) {
-        ret += pr_str(MalKeyToMalType(it->first), print_readably) + ' ';
-        ret += pr_str(it->second, print_readably);
-        if (++it == e.end()) {
-            break;
-        }
-        ret += ' ';
+static void pr_string(string& out, const MalString& s, bool print_readably) {
+    if (print_readably) {
+        out += '"';
+        mal_escape::escape(out, s.data.str().data(), s.data.size(),
+                           mal_escape::CONTROL_CHARS);
+        out += '"';
+    } else {
+        out += s.data.str();
     }
-
-    return ret + "}";
 }
 
-static string pr_number(const MalNumber& n, bool print_readably) {
-    return to_string(n.data);
+static void pr_keyword(string& out, const MalKeyword& k, bool print_readably) {
+    out += ':';
+    out += k.data.str();
 }
 
-static string pr_symbol(const MalSymbol& s, bool print_readably) {
-    return s.data;
-}
-
-static string pr_nil(const MalNil& nil, bool print_readably) {
-    return "nil";
-}
-
-static string pr_bool(const MalBool& b, bool print_readably) {
-    return b.data ? "true" : "false";
-}
-
-static string pr_string(const MalString& s, bool print_readably) {
-    return (print_readably ? '"' + encode_string(s.data) + '"' : s.data);
+static void pr_hashmap(string& out, const MalHashmap& v, bool print_readably) {
+    out += '{';
+    for (auto it = v.data.begin(); it != v.data.end(); ++it) {
+        if (it != v.data.begin()) {
+            out += ' ';
+        }
+        visit([&](auto&& k) {
+            using T = decay_t<decltype(k)>;
+            if constexpr (is_same_v<T, MalString>)
+                pr_string(out, k, print_readably);
+            if constexpr (is_same_v<T, MalKeyword>)
+                pr_keyword(out, k, print_readably);
+        }, it->first);
+        out += ' ';
+        pr_str(out, it->second, print_readably);
+    }
+    out += '}';
 }
 
-static string pr_keyword(const MalKeyword& k, bool print_readably) {
-    return ':' + k.data;
+static void pr_number(string& out, const MalNumber& n, bool print_readably) {
+    char buf[16];
+    auto end = to_chars(buf, buf + sizeof(buf), n.data).ptr;
+    out.append(buf, end);
 }
 
-static string pr_atom(const MalAtom& atom, bool print_readably) {
-    return "(atom " + pr_str(atom.data, print_readably) + ")";
+static void pr_atom(string& out, const MalAtom& atom, bool print_readably) {
+    out += "(atom ";
+    pr_str(out, atom.data, print_readably);
+    out += ')';
 }
 
-string pr_str(const MalType& ast, bool print_readably) {
-    return visit([&](auto&& v) -> string {
+void pr_str(string& out, const MalType& ast, bool print_readably) {
+    visit([&](auto&& v) {
         using T = decay_t<decltype(v)>;
         if constexpr (is_same_v<T, MalNumber>)
-            return pr_number(v, print_readably);
+            pr_number(out, v, print_readably);
         if constexpr (is_same_v<T, MalSymbol>)
-            return pr_symbol(v, print_readably);
+            out += v.name();
         if constexpr (is_same_v<T, MalNil>)
-            return pr_nil(v, print_readably);
+            out += "nil";
         if constexpr (is_same_v<T, MalBool>)
-            return pr_bool(v, print_readably);
+            out += v.data ? "true" : "false";
         if constexpr (is_same_v<T, MalString>)
-            return pr_string(v, print_readably);
+            pr_string(out, v, print_readably);
         if constexpr (is_same_v<T, MalKeyword>)
-            return pr_keyword(v, print_readably);
+            pr_keyword(out, v, print_readably);
         if constexpr (is_same_v<T, shared_ptr<MalList>>)
-            return pr_list(*v, print_readably);
+            pr_list(out, *v, print_readably);
         if constexpr (is_same_v<T, shared_ptr<MalVector>>)
-            return pr_vector(*v, print_readably);
+            pr_vector(out, *v, print_readably);
         if constexpr (is_same_v<T, shared_ptr<MalHashmap>>)
-            return pr_hashmap(*v, print_readably);
+            pr_hashmap(out, *v, print_readably);
         if constexpr (is_same_v<T, shared_ptr<MalFunction>>)
-            return "#<function>";
+            out += "#<function>";
         if constexpr (is_same_v<T, shared_ptr<MalAtom>>)
-            return pr_atom(*v, print_readably);
-        return "<unknown>";
+            pr_atom(out, *v, print_readably);
     }, ast);
 }
+
+void pr_str(string& out, span<const MalType> values, string_view sep,
+            bool print_readably) {
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (i != 0) {
+            out += sep;
+        }
+        pr_str(out, values[i], print_readably);
+    }
+}
+
+string pr_str(const MalType& ast, bool print_readably) {
+    string out;
+    pr_str(out, ast, print_readably);
+    return out;
+}
@@ -2,9 +2,21 @@
 #define _PRINTER_H_
 
 #include <string>
+#include <span>
+#include <string_view>
 
 #include "types.h"
 
+// Appends the printed form of ast to out. Nested values are written
+// straight into out, so printing costs O(size) however deep the value is,
+// and a caller that keeps out around reuses its capacity.
+void pr_str(std::string& out, const MalType& ast, bool print_readably);
+
+// Appends each of values, separated by sep, as prn, println, str and
+// pr-str print their arguments.
+void pr_str(std::string& out, std::span<const MalType> values,
+            std::string_view sep, bool print_readably);
+
 std::string pr_str(const MalType& ast, bool print_readably);
 
 #endif // _PRINTER_H_
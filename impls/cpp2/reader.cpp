@@ -1,32 +1,15 @@
-#include <regex>
 #include <cctype>
 #include <cstdio>
+#include <charconv>
+#include <algorithm>
 
 #include "reader.h"
 #include "util.h"
+#include "../cpp-common/escape.h"
 
 using namespace std;
 using namespace ranges;
 
-struct regex_view : view_interface<regex_view> {
-    using iterator = sregex_iterator;
-
-    regex_view(const string& str, const regex& re)
-        : m_str(&str), m_re(&re) {}
-
-    iterator begin() const {
-        return sregex_iterator(m_str->begin(), m_str->end(), *m_re);
-    }
-
-    iterator end() const {
-        return sregex_iterator();
-    }
-
-private:
-    const string* m_str;
-    const regex* m_re;
-};
-
 static bool is_left_bracket(char c) {
     constexpr string_view brackets = "({[";
     return brackets.find(c) != string::npos;
@@ -37,10 +20,6 @@ static bool is_right_bracket(char c) {
     return brackets.find(c) != string::npos;
 }
 
-static bool is_bracket(char c) {
-    return is_left_bracket(c) || is_right_bracket(c);
-}
-
 static char opposite_bracket(char c) {
     switch (c) {
         case '(': return ')';
@@ -54,47 +33,97 @@ static char opposite_bracket(char c) {
     return c;
 }
 
-static bool is_balanced_string(const string& s) {
-    static const regex balanced(R"(^"(?:\\.|[^\\"])*"$)");
-    return regex_match(s, balanced);
+static bool is_space(char c) {
+    constexpr string_view spaces = " \t\n\v\f\r,";
+    return spaces.find(c) != string::npos;
+}
+
+static bool is_special(char c) {
+    constexpr string_view specials = "[]{}()'`~^@";
+    return specials.find(c) != string::npos;
+}
+
+static bool is_symbol_char(char c) {
+    constexpr string_view delimiters = "[]{}('\"`,;)";
+    return !is_space(c) && delimiters.find(c) == string::npos;
 }
 
+static bool is_number(string_view token) {
+    if (!token.empty() && (token[0] == '+' || token[0] == '-')) {
+        token.remove_prefix(1);
+    }
+    return !token.empty() && ranges::all_of(token, [](char c) { return isdigit(c); });
+}
 
-static string decode_string(const string& s) {
-    return regex_replace_callback(s, regex(R"(\\\\|\\n|\\t|\\r|\\b|\\")"),
-        [] (const smatch& m) -> string {
-            switch (m.str()[1]) {
-                case '\\': return "\\";
-                case 'n': return "\n";
-                case 't': return "\t";
-                case 'r': return "\r";
-                case 'b': return "\b";
-                case '"': return "\"";
+// Whether a token starting with '"' is closed by its last character.
+static bool is_balanced_string(string_view s) {
+    for (size_t i = 1; i < s.size(); ++i) {
+        if (s[i] == '\\') {
+            ++i;
+        } else if (s[i] == '"') {
+            return i + 1 == s.size();
+        }
+    }
+    return false;
+}
+
+// Same tokens as the regex
+//   [\s,]*(~@|[\[\]{}()'`~^@]|"(?:\\.|[^\\"])*"?|;.*|[^\s\[\]{}('"`,;)]*)
+// with comments dropped.
+void Reader::advance() {
+    while (true) {
+        size_t i = 0;
+        while (i < m_rest.size() && is_space(m_rest[i])) {
+            ++i;
+        }
+        m_rest.remove_prefix(i);
+
+        if (m_rest.empty()) {
+            m_token = {};
+            return;
+        }
+
+        size_t len = 1;
+        char c = m_rest[0];
+
+        if (c == '~' && m_rest.size() > 1 && m_rest[1] == '@') {
+            len = 2;
+        } else if (is_special(c)) {
+            len = 1;
+        } else if (c == '"') {
+            while (len < m_rest.size() && m_rest[len] != '"') {
+                len += (m_rest[len] == '\\' && len + 1 < m_rest.size()) ? 2 : 1;
             }
-            return "";
-        });
+            len = std::min(len + 1, m_rest.size());
+        } else if (c == ';') {
+            len = std::min(m_rest.find('\n'), m_rest.size());
+        } else {
+            while (len < m_rest.size() && is_symbol_char(m_rest[len])) {
+                ++len;
+            }
+        }
+
+        m_token = m_rest.substr(0, len);
+        m_rest.remove_prefix(len);
+
+        if (c != ';') return;
+    }
 }
 
-auto tokenize(const string& str, const regex& re) {
-    return regex_view(str, re)
-        | views::transform([] (const auto& m) { return m[1].matched ? m[1].str() : m.str(); })
-        | views::filter([] (auto token) { return !token.empty(); })
-        | views::filter([] (auto token) { return token[0] != ';'; });
+static string decode_string(string_view s) {
+    string ret;
+    mal_escape::unescape(ret, s.data(), s.size(),
+                         mal_escape::CONTROL_CHARS | mal_escape::KEEP_UNKNOWN);
+    return ret;
 }
 
-template <typename T>
-MalType read_form(Reader<T>& reader);
-template <typename T>
-shared_ptr<MalList> read_list(Reader<T>& reader);
-template <typename T>
-shared_ptr<MalVector> read_vector(Reader<T>& reader);
-template <typename T>
-shared_ptr<MalHashmap> read_hashmap(Reader<T>& reader);
-template <typename T>
-MalType read_atom(Reader<T>& reader);
-
-template <typename T>
-MalType read_form(Reader<T>& reader) {
+static MalType read_form(Reader& reader);
+static shared_ptr<MalList> read_list(Reader& reader);
+static shared_ptr<MalVector> read_vector(Reader& reader);
+static shared_ptr<MalHashmap> read_hashmap(Reader& reader);
+static MalType read_atom(Reader& reader);
+
+static MalType read_form(Reader& reader) {
     auto token = reader.peek();
     if (token.empty()) {
         throw MalSyntaxError("EOF");
@@ -110,61 +139,43 @@ MalType read_form(Reader<T>& reader) {
         throw MalSyntaxError("unbalanced");
     } else if (token == "'") {
         reader.next();
-        auto l = make_shared<MalList>();
-        l->data.push_back(MalSymbol("quote"));
-        l->data.push_back(read_form(reader));
-        return l;
+        return make_shared<MalList>(MalList::T{ MalSymbol("quote"), read_form(reader) });
     } else if (token == "`") {
         reader.next();
-        auto l = make_shared<MalList>();
-        l->data.push_back(MalSymbol("quasiquote"));
-        l->data.push_back(read_form(reader));
-        return l;
+        return make_shared<MalList>(MalList::T{ MalSymbol("quasiquote"), read_form(reader) });
     } else if (token == "~") {
         reader.next();
-        auto l = make_shared<MalList>();
-        l->data.push_back(MalSymbol("unquote"));
-        l->data.push_back(read_form(reader));
-        return l;
+        return make_shared<MalList>(MalList::T{ MalSymbol("unquote"), read_form(reader) });
     } else if (token == "~@") {
         reader.next();
-        auto l = make_shared<MalList>();
-        l->data.push_back(MalSymbol("splice-unquote"));
-        l->data.push_back(read_form(reader));
-        return l;
+        return make_shared<MalList>(MalList::T{ MalSymbol("splice-unquote"), read_form(reader) });
     } else if (token == "@") {
         reader.next();
-        auto l = make_shared<MalList>();
-        l->data.push_back(MalSymbol("deref"));
-        l->data.push_back(read_form(reader));
-        return l;
+        return make_shared<MalList>(MalList::T{ MalSymbol("deref"), read_form(reader) });
     } else {
         return read_atom(reader);
     }
 }
 
-template <typename T>
-shared_ptr<MalList> read_list(Reader<T>& reader) {
+static shared_ptr<MalList> read_list(Reader& reader) {
     auto token = reader.next();
     if (token != "(") {
         throw MalSyntaxError("unbalanced");
     }
 
     auto ob = string() + opposite_bracket(token[0]);
-    auto ls = make_shared<MalList>();
+    vector<MalType> items;
 
     while (reader.peek() != ob) {
-        auto token = reader.peek();
-        ls->data.push_back(read_form(reader));
+        items.push_back(read_form(reader));
     }
 
     reader.next();
 
-    return ls;
+    return make_shared<MalList>(MalList::T(std::move(items)));
 }
 
-template <typename T>
-shared_ptr<MalVector> read_vector(Reader<T>& reader) {
+static shared_ptr<MalVector> read_vector(Reader& reader) {
     auto token = reader.next();
     if (token != "[") {
         throw MalSyntaxError("unbalanced");
@@ -174,7 +185,6 @@ shared_ptr<MalVector> read_vector(Reader<T>& reader) {
     auto vec = make_shared<MalVector>();
 
     while (reader.peek() != ob) {
-        auto token = reader.peek();
         vec->data.push_back(read_form(reader));
     }
 
@@ -183,8 +193,7 @@ shared_ptr<MalVector> read_vector(Reader<T>& reader) {
     return vec;
 }
 
-template <typename T>
-shared_ptr<MalHashmap> read_hashmap(Reader<T>& reader) {
+static shared_ptr<MalHashmap> read_hashmap(Reader& reader) {
     auto token = reader.next();
     if (token != "{") {
         throw MalSyntaxError("unbalanced");
@@ -214,10 +223,23 @@ shared_ptr<MalHashmap> read_hashmap(Reader<T>& reader) {
     return hm;
 }
 
-template <typename T>
-MalType read_atom(Reader<T>& reader) {
-    static const regex num_regex(R"(^[+-]?\d+$)", regex::optimize);
+static MalType read_number(string_view token) {
+    if (!is_number(token)) {
+        throw MalSyntaxError("invalid number");
+    }
+    if (token[0] == '+') {
+        token.remove_prefix(1);
+    }
+
+    MalNumber::T n;
+    auto [end, ec] = from_chars(token.data(), token.data() + token.size(), n);
+    if (ec != errc()) {
+        throw MalSyntaxError("invalid number");
+    }
+    return MalNumber(n);
+}
 
+static MalType read_atom(Reader& reader) {
     auto token = reader.next();
     if (token.empty()) {
         throw MalSyntaxError("EOF");
@@ -227,19 +249,11 @@ MalType read_atom(Reader<T>& reader) {
         if (!is_balanced_string(token)) {
             throw MalSyntaxError("unbalanced");
         }
-        auto str = string(token.begin() + 1, token.end() - 1);
-        return MalString(decode_string(str));
+        return MalString(decode_string(token.substr(1, token.size() - 2)));
     } else if (token[0] == ':') { // keyword
-        auto str = string(token.begin() + 1, token.end());
-        return MalKeyword(str);
-    } else if (isdigit(token[0])) { // number
-        if (regex_match(token, num_regex)) { 
-            return MalNumber(stoi(token));
-        } else {
-            throw MalSyntaxError("invalid number");
-        }
-    } else if (regex_match(token, num_regex)) {
-        return MalNumber(stoi(token));
+        return MalKeyword(string(token.substr(1)));
+    } else if (isdigit(token[0]) || is_number(token)) { // number
+        return read_number(token);
     } else if (token == "nil") { // nil
         return MalNil();
     } else if (token == "true") { // true
@@ -247,16 +261,76 @@ MalType read_atom(Reader<T>& reader) {
     } else if (token == "false") { // false
         return MalBool(false);
     } else { // symbol
-        return MalSymbol(::std::move(token));
+        return MalSymbol(string(token));
     }
 }
 
 MalType read_str(const string& str) {
-    auto re = regex(R"([\s,]*(~@|[\[\]{}()'`~^@]|"(?:\\.|[^\\"])*"?|;.*|[^\s\[\]{}('"`,;)]*))");
-    auto tokenizer = tokenize(str, re);
-    if (tokenizer.begin() == tokenizer.end()) {
+    Reader reader(str);
+    if (reader.peek().empty()) {
         throw MalNoToken();
     }
-    auto reader = make_reader(::std::move(tokenizer));
+    return read_form(reader);
+}
+
+static bool is_macro_prefix(string_view token) {
+    return token == "'" || token == "`" || token == "~" || token == "~@" || token == "@";
+}
+
+// Scans the tokens after m_scanned and returns where the current form ends,
+// or npos if it isn't all in the buffer yet. A token that reaches the end
+// of the buffer might go on in the next chunk, so it only counts at EOF.
+size_t FormReader::scan() {
+    Reader reader(string_view(m_buf).substr(m_scanned));
+
+    for (auto token = reader.next(); !token.empty(); token = reader.next()) {
+        size_t end = token.data() + token.size() - m_buf.data();
+        if (end == m_buf.size() && !m_eof) {
+            break;
+        }
+        m_scanned = end;
+
+        if (is_left_bracket(token[0])) {
+            ++m_depth;
+        } else if (is_right_bracket(token[0]) && m_depth > 0) {
+            --m_depth;
+        }
+
+        if (m_depth == 0 && !is_macro_prefix(token)) {
+            return end;
+        }
+    }
+
+    return string::npos;
+}
+
+void FormReader::fill() {
+    m_buf.erase(0, m_pos);
+    m_scanned -= m_pos;
+    m_pos = 0;
+
+    auto size = m_buf.size();
+    m_buf.resize(size + m_chunk_size);
+    m_in.read(m_buf.data() + size, m_chunk_size);
+    m_buf.resize(size + m_in.gcount());
+
+    m_eof = !m_in;
+}
+
+optional<MalType> FormReader::next() {
+    auto end = scan();
+    while (end == string::npos && !m_eof) {
+        fill();
+        end = scan();
+    }
+
+    // At EOF with an unfinished form, let read_form report the error.
+    Reader reader(string_view(m_buf).substr(m_pos, end == string::npos ? end : end - m_pos));
+    if (reader.peek().empty()) {
+        return nullopt;
+    }
+
+    m_pos = m_scanned = (end == string::npos ? m_buf.size() : end);
+    m_depth = 0;
     return read_form(reader);
 }
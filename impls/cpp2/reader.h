@@ -1,46 +1,41 @@
 #ifndef _READER_H_
 #define _READER_H_
 
-#include <ranges>
+#include <string_view>
+#include <istream>
+#include <optional>
 #include <utility>
 #include <memory>
 #include <stdexcept>
 
 #include "types.h"
 
-template <typename T>
+// Splits the input into tokens on demand. Tokens are views into the
+// input, which must outlive the reader; comments are skipped and the
+// empty token means end of input.
 class Reader {
-private:
-    using iterator = std::ranges::iterator_t<T>;
-
 public:
-    template <typename U>
-    Reader(U&& tokenizer)
-        : m_tokenizer(std::forward<U>(tokenizer))
-        , m_cur(m_tokenizer.begin())
-        , m_last(m_tokenizer.end())
+    explicit Reader(std::string_view input)
+        : m_rest(input)
     {
+        advance();
     }
 
-    std::string next() {
-        if (m_cur == m_last) return "";
-        return *m_cur++;
+    std::string_view next() {
+        auto token = m_token;
+        advance();
+        return token;
     }
-    std::string peek() const {
-        if (m_cur == m_last) return "";
-        return *m_cur;
+    std::string_view peek() const {
+        return m_token;
     }
 
 private:
-    T m_tokenizer;
-    iterator m_cur;
-    iterator m_last;
-};
+    void advance();
 
-template <typename T>
-auto make_reader(T&& tokenizer) {
-    return Reader<T>(std::forward<T>(tokenizer));
-}
+    std::string_view m_token;
+    std::string_view m_rest;
+};
 
 class MalSyntaxError: public std::runtime_error {
 public:
@@ -66,5 +61,32 @@ public:
 
 MalType read_str(const std::string& str);
 
+// Reads top-level forms one at a time from a stream. Input is read in
+// chunks and only kept until the form it belongs to has been read, so the
+// buffer never holds much more than the largest single form.
+class FormReader {
+public:
+    explicit FormReader(std::istream& in, std::size_t chunk_size = 64 * 1024)
+        : m_in(in)
+        , m_chunk_size(chunk_size)
+    { }
+
+    // The next form, or nullopt at the end of the stream.
+    std::optional<MalType> next();
+
+private:
+    std::size_t scan();
+    void fill();
+
+    std::istream& m_in;
+    std::size_t m_chunk_size;
+    bool m_eof = false;
+
+    std::string m_buf;
+    std::size_t m_pos = 0;      // start of the form being read
+    std::size_t m_scanned = 0;  // end of the last token known to be whole
+    unsigned m_depth = 0;
+};
+
 
 #endif // _READER_H_
@@ -0,0 +1,257 @@
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "resolver.h"
+
+using namespace std;
+
+namespace {
+
+struct Scope {
+    shared_ptr<const MalList::Layout> names;
+    size_t visible;                  // names[0, visible) are bound here
+    vector<MalSymbol::Id> defined;   // def!'d in this frame, so never resolved
+};
+
+using Scopes = vector<Scope>; // innermost last
+
+} // namespace
+
+static MalType resolve(const MalType& ast, Scopes& scopes);
+
+static bool is_form(const MalType& ast, MalSymbol::Id id) {
+    auto ls = get_if<sptr<MalList>>(&ast);
+    if (!ls || (*ls)->data.empty()) return false;
+    auto head = get_if<MalSymbol>(&(*ls)->data.front());
+    return head && head->id == id;
+}
+
+// Whether a fn* or let* form has a parameter or binding list eval()
+// accepts. Those it does not are left alone, to fail when evaluated.
+static bool is_well_formed(const sptr<MalList>& ls) {
+    if (ls->data.size() < 2) return false;
+    bool is_let = is_form(ls, SYM_LET);
+
+    return visit([&](auto&& cont) {
+        using T = decay_t<decltype(cont)>;
+        if constexpr (is_same_v<T, sptr<MalList>>
+                || is_same_v<T, sptr<MalVector>>) {
+            if (is_let && cont->data.size() % 2) return false;
+
+            size_t i = 0;
+            for (auto& v: cont->data) {
+                bool is_name = !is_let || i % 2 == 0;
+                if (is_name && !holds_alternative<MalSymbol>(v)) return false;
+                // A fn*'s & must be followed by exactly one name.
+                if (!is_let && get<MalSymbol>(v).name() == "&"
+                        && i + 2 != cont->data.size()) return false;
+                ++i;
+            }
+            return true;
+        }
+        return false;
+    }, *next(ls->data.begin()));
+}
+
+// Names def!'d by forms evaluated in the current frame. Nested fn* and
+// let* forms get frames of their own.
+static void collect_defs(const MalType& ast, vector<MalSymbol::Id>& defs) {
+    if (is_form(ast, SYM_QUOTE) || is_form(ast, SYM_FN) || is_form(ast, SYM_LET)) {
+        return;
+    }
+    if (auto ls = get_if<sptr<MalList>>(&ast)) {
+        if (is_form(ast, SYM_DEF) && (*ls)->data.size() > 1) {
+            if (auto sym = get_if<MalSymbol>(&*next((*ls)->data.begin()))) {
+                defs.push_back(sym->id);
+            }
+        }
+        for (auto& v: (*ls)->data) {
+            collect_defs(v, defs);
+        }
+    } else if (auto vec = get_if<sptr<MalVector>>(&ast)) {
+        for (auto& v: (*vec)->data) {
+            collect_defs(v, defs);
+        }
+    } else if (auto hm = get_if<sptr<MalHashmap>>(&ast)) {
+        for (auto& [k, v]: (*hm)->data) {
+            collect_defs(v, defs);
+        }
+    }
+}
+
+static MalSymbol resolve_symbol(MalSymbol sym, const Scopes& scopes) {
+    for (size_t depth = 0; depth < scopes.size(); ++depth) {
+        auto& scope = scopes[scopes.size() - 1 - depth];
+
+        if (ranges::find(scope.defined, sym.id) != scope.defined.end()) {
+            return sym;
+        }
+        for (auto slot = scope.visible; slot--;) {
+            if ((*scope.names)[slot] != sym.id) continue;
+
+            if (depth <= numeric_limits<decltype(sym.depth)>::max()
+                    && slot <= numeric_limits<decltype(sym.slot)>::max()) {
+                sym.binding = MalSymbol::LOCAL;
+                sym.depth = depth;
+                sym.slot = slot;
+            }
+            return sym;
+        }
+    }
+
+    sym.binding = MalSymbol::GLOBAL;
+    return sym;
+}
+
+template <typename It>
+static vector<MalType> resolve_all(It first, It last, Scopes& scopes) {
+    vector<MalType> ret;
+    ret.reserve(distance(first, last));
+    for (; first != last; ++first) {
+        ret.push_back(resolve(*first, scopes));
+    }
+    return ret;
+}
+
+// (fn* params body...)
+static sptr<MalList> resolve_fn(const sptr<MalList>& ls, const Scopes& outer) {
+    auto it = next(ls->data.begin());
+    auto layout = make_shared<MalList::Layout>();
+
+    visit([&](auto&& params) {
+        using T = decay_t<decltype(params)>;
+        if constexpr (is_same_v<T, sptr<MalList>>
+                || is_same_v<T, sptr<MalVector>>) {
+            for (auto& param: params->data) {
+                auto& sym = get<MalSymbol>(param);
+                if (sym.name() != "&") {
+                    layout->push_back(sym.id);
+                }
+            }
+        }
+    }, *it);
+    ++it;
+
+    // The body usually runs after the enclosing let*s have bound
+    // everything. When it runs sooner, eval() looks up the names whose
+    // slots are still unbound by name instead.
+    Scopes scopes = outer;
+    for (auto& scope: scopes) {
+        scope.visible = scope.names->size();
+    }
+    scopes.push_back({ layout, layout->size(), {} });
+    for (auto body = it; body != ls->data.end(); ++body) {
+        collect_defs(*body, scopes.back().defined);
+    }
+
+    auto body = make_shared<const vector<MalType>>(resolve_all(it, ls->data.end(), scopes));
+    vector<MalType> items{ ls->data.front(), *next(ls->data.begin()) };
+    items.insert(items.end(), body->begin(), body->end());
+
+    return make_shared<MalList>(MalList::T(std::move(items)), layout, body);
+}
+
+// (let* (name init ...) body...)
+static sptr<MalList> resolve_let(const sptr<MalList>& ls, Scopes& scopes) {
+    auto it = next(ls->data.begin());
+    auto layout = make_shared<MalList::Layout>();
+    vector<MalType> bindings;
+
+    scopes.push_back({ layout, 0, {} });
+    auto depth = scopes.size() - 1; // scopes may grow while resolving
+
+    visit([&](auto&& cont) {
+        using T = decay_t<decltype(cont)>;
+        if constexpr (is_same_v<T, sptr<MalList>>
+                || is_same_v<T, sptr<MalVector>>) {
+            for (auto b = cont->data.begin(); b != cont->data.end(); b += 2) {
+                layout->push_back(get<MalSymbol>(*b).id);
+                collect_defs(*next(b), scopes[depth].defined);
+            }
+            for (auto body = next(it); body != ls->data.end(); ++body) {
+                collect_defs(*body, scopes[depth].defined);
+            }
+
+            // Each init sees the names bound before it.
+            for (auto b = cont->data.begin(); b != cont->data.end(); b += 2) {
+                bindings.push_back(*b);
+                bindings.push_back(resolve(*next(b), scopes));
+                ++scopes[depth].visible;
+            }
+        }
+    }, *it);
+    ++it;
+
+    auto items = resolve_all(it, ls->data.end(), scopes);
+    scopes.pop_back();
+
+    items.insert(items.begin(), {
+        ls->data.front(),
+        make_shared<MalVector>(std::move(bindings)),
+    });
+
+    return make_shared<MalList>(MalList::T(std::move(items)), layout);
+}
+
+static MalType resolve(const MalType& ast, Scopes& scopes) {
+    return visit([&](auto&& v) -> MalType {
+        using T = decay_t<decltype(v)>;
+
+        if constexpr (is_same_v<T, MalSymbol>) {
+            return resolve_symbol(v, scopes);
+        }
+        if constexpr (is_same_v<T, sptr<MalList>>) {
+            if (v->layout || is_form(v, SYM_QUOTE) || is_form(v, SYM_QUASIQUOTE)) {
+                return v;
+            }
+            if (is_form(v, SYM_FN) && is_well_formed(v)) {
+                return resolve_fn(v, scopes);
+            }
+            if (is_form(v, SYM_LET) && is_well_formed(v)) {
+                return resolve_let(v, scopes);
+            }
+            if (is_form(v, SYM_DEF) && v->data.size() == 3) {
+                auto it = next(v->data.begin());
+                return make_shared<MalList>(MalList::T{
+                    v->data.front(), *it, resolve(*next(it), scopes)
+                });
+            }
+            auto items = resolve_all(v->data.begin(), v->data.end(), scopes);
+            return make_shared<MalList>(MalList::T(std::move(items)));
+        }
+        if constexpr (is_same_v<T, sptr<MalVector>>) {
+            return make_shared<MalVector>(
+                resolve_all(v->data.begin(), v->data.end(), scopes));
+        }
+        if constexpr (is_same_v<T, sptr<MalHashmap>>) {
+            auto hm = make_shared<MalHashmap>();
+            for (auto& [k, val]: v->data) {
+                hm->data.emplace(k, resolve(val, scopes));
+            }
+            return hm;
+        }
+        return v;
+    }, ast);
+}
+
+sptr<MalList> resolve_form(const sptr<MalList>& form, const sptr<MalEnv>& env) {
+    if (!is_well_formed(form)) {
+        return nullptr;
+    }
+
+    Scopes scopes;
+
+    for (auto frame = env.get(); frame->layout(); frame = frame->outer().get()) {
+        Scope scope{ frame->layout(), frame->layout()->size(), {} };
+        for (auto& [id, v]: frame->vars()) {
+            scope.defined.push_back(id);
+        }
+        scopes.insert(scopes.begin(), std::move(scope));
+    }
+
+    if (is_form(form, SYM_FN)) {
+        return resolve_fn(form, scopes);
+    }
+    return resolve_let(form, scopes);
+}
@@ -0,0 +1,19 @@
+#ifndef _MY_RESOLVER_H_
+#define _MY_RESOLVER_H_
+
+#include <memory>
+
+#include "environment.h"
+
+// Returns a copy of a fn* or let* form, about to be evaluated in env,
+// in which every symbol in an evaluated position records where its
+// binding lives (see MalSymbol::Binding), and which carries the layout
+// of the frame it creates. Nested fn* and let* forms are resolved along
+// with it, so eval() only resolves the forms it has not seen yet: top
+// level ones and those built by quasiquote at run time.
+//
+// Returns null if the parameter or binding list is malformed.
+std::shared_ptr<MalList> resolve_form(const std::shared_ptr<MalList>& form,
+                                      const std::shared_ptr<MalEnv>& env);
+
+#endif // _MY_RESOLVER_H_
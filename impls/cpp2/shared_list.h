@@ -0,0 +1,102 @@
+#ifndef _MY_SHARED_LIST_H_
+#define _MY_SHARED_LIST_H_
+
+#include <vector>
+#include <memory>
+#include <iterator>
+#include <algorithm>
+#include <initializer_list>
+#include <cassert>
+
+//
+// An immutable list stored in one contiguous buffer that is shared
+// between lists.
+//
+// The elements are kept back to front, so a list is the first m_size
+// elements of m_buf read in reverse, and its head is m_buf[m_size - 1].
+// That makes rest() a view of the same buffer with one element less, and
+// lets cons() write the new head in place whenever this list is the
+// longest one using the buffer. Other lists never see the new element,
+// since their size does not change.
+//
+// cons() never grows the buffer in place: a reallocation would move the
+// elements under every other list's iterators. When the capacity runs
+// out it copies into a new buffer of twice the size instead.
+//
+template <typename T>
+class SharedList {
+private:
+    using Buffer = std::vector<T>;
+
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using const_iterator = typename Buffer::const_reverse_iterator;
+    using iterator = const_iterator;
+
+    SharedList() = default;
+
+    SharedList(std::initializer_list<T> items)
+        : SharedList(Buffer(items))
+    { }
+
+    template <std::input_iterator It, std::sentinel_for<It> S>
+    SharedList(It first, S last)
+        : SharedList(Buffer(first, last))
+    { }
+
+    explicit SharedList(Buffer items)
+        : m_size(items.size())
+    {
+        if (items.empty()) return;
+        std::reverse(items.begin(), items.end());
+        m_buf = std::make_shared<Buffer>(std::move(items));
+    }
+
+    size_type size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    const_iterator begin() const {
+        return m_buf ? const_iterator(m_buf->begin() + m_size) : const_iterator();
+    }
+    const_iterator end() const {
+        return m_buf ? m_buf->crend() : const_iterator();
+    }
+    auto rbegin() const { return std::make_reverse_iterator(end()); }
+    auto rend() const { return std::make_reverse_iterator(begin()); }
+
+    const T& front() const { assert(m_size); return (*m_buf)[m_size - 1]; }
+    const T& back() const { assert(m_size); return (*m_buf)[0]; }
+
+    SharedList rest() const {
+        assert(m_size);
+        SharedList ret = *this;
+        --ret.m_size;
+        return ret;
+    }
+
+    SharedList cons(T head) const {
+        SharedList ret;
+
+        if (m_buf && m_buf->size() == m_size
+                && m_buf->size() < m_buf->capacity()) {
+            ret.m_buf = m_buf;
+        } else {
+            ret.m_buf = std::make_shared<Buffer>();
+            ret.m_buf->reserve(std::max<size_type>(2 * m_size, 4));
+            if (m_buf) {
+                ret.m_buf->assign(m_buf->begin(), m_buf->begin() + m_size);
+            }
+        }
+
+        ret.m_buf->push_back(std::move(head));
+        ret.m_size = m_size + 1;
+        return ret;
+    }
+
+private:
+    std::shared_ptr<Buffer> m_buf;
+    size_type m_size = 0;
+};
+
+#endif // _MY_SHARED_LIST_H_
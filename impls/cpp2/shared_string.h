@@ -0,0 +1,54 @@
+#ifndef _MY_SHARED_STRING_H_
+#define _MY_SHARED_STRING_H_
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <functional>
+
+//
+// An immutable string whose text is shared between copies, so copying
+// one bumps a reference count instead of copying characters. Strings and
+// keywords hold their text this way, which keeps them as small as the
+// other MalType alternatives.
+//
+// The empty string holds no buffer at all.
+//
+class SharedString {
+public:
+    SharedString() = default;
+
+    SharedString(std::string text)
+        : m_text(text.empty() ? nullptr
+                 : std::make_shared<const std::string>(std::move(text)))
+    { }
+
+    SharedString(const char* text)
+        : SharedString(std::string(text))
+    { }
+
+    const std::string& str() const {
+        static const std::string empty;
+        return m_text ? *m_text : empty;
+    }
+    operator const std::string&() const { return str(); }
+
+    std::size_t size() const { return str().size(); }
+    bool empty() const { return !m_text; }
+
+    bool operator==(const SharedString& other) const {
+        return m_text == other.m_text || str() == other.str();
+    }
+
+private:
+    std::shared_ptr<const std::string> m_text;
+};
+
+template <>
+struct std::hash<SharedString> {
+    std::size_t operator()(const SharedString& s) const {
+        return std::hash<std::string>{}(s.str());
+    }
+};
+
+#endif // _MY_SHARED_STRING_H_
@@ -22,22 +22,16 @@ static void add_core_fn(MalEnv& env) {
     }
     rep("(def! not (fn* (a) (if a false true)))");
     rep("(def! compose (fn* (f g) (fn* (x) (g (f x)))))");
-    rep(
-        "(def! load-file                                           "
-        "   (let* (do-str (fn* (s) (str \"(do \" s \" nil)\"))     "
-        "          eval-from-string (compose read-string eval))    "
-        "       (compose (compose slurp do-str) eval-from-string)))"
-    );
 }
 
 static void add_argv(int argc, char* argv[]) {
-    auto ls = make_shared<MalList>();
+    vector<MalType> args;
 
     for (int i = 2; i < argc; ++i) {
-        ls->data.push_back(MalString(argv[i]));
+        args.push_back(MalString(argv[i]));
     }
 
-    repl_env->set("*ARGV*", std::move(ls));
+    repl_env->set("*ARGV*", make_shared<MalList>(MalList::T(std::move(args))));
 }
 
 int main(int argc, char* argv[]) {
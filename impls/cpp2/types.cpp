@@ -1,4 +1,6 @@
 #include <cstdint>
+#include <deque>
+#include <string_view>
 
 #include "types.h"
 
@@ -7,11 +9,44 @@ using namespace std;
 // static const string KEYWORD_PREFIX = u8"\u029E";
 static const string KEYWORD_PREFIX = "\u029E";
 
+MalSymbol::MalSymbol(string_view name)
+    : id(intern(name))
+{ }
+
+// Names by id. A deque never moves its elements, so the references
+// name_of() hands out stay valid as more names are interned.
+static deque<string>& symbol_names() {
+    static deque<string> names;
+    return names;
+}
+
+MalSymbol::Id MalSymbol::intern(string_view name) {
+    // Seeded with the SymbolId names; any new name takes the next id.
+    static unordered_map<string_view, Id> table = [] {
+        unordered_map<string_view, Id> table;
+        for (auto seed : { "def!", "let*", "do", "if", "fn*", "quote",
+                           "quasiquote", "unquote", "splice-unquote" }) {
+            symbol_names().emplace_back(seed);
+            table.emplace(symbol_names().back(), table.size());
+        }
+        return table;
+    }();
+
+    auto it = table.find(name);
+    if (it != table.end()) return it->second;
+    symbol_names().emplace_back(name);
+    return table.emplace(symbol_names().back(), table.size()).first->second;
+}
+
+const MalSymbol::T& MalSymbol::name_of(Id id) {
+    return symbol_names()[id];
+}
+
 size_t MalHashmap::KeyHash::operator()(const Key& k) const {
     return visit([](auto&& v) -> size_t {
         using T = decay_t<decltype(v)>;
         if constexpr (is_same_v<T, MalString>)  return hash<string>{}(v.data);
-        if constexpr (is_same_v<T, MalKeyword>) return hash<string>{}(KEYWORD_PREFIX + v.data);
+        if constexpr (is_same_v<T, MalKeyword>) return hash<string>{}(KEYWORD_PREFIX + v.data.str());
     }, k);
 }
 
@@ -1,14 +1,18 @@
 #ifndef _TYPES_H_
 #define _TYPES_H_
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <list>
 #include <unordered_map>
 #include <memory>
+#include <span>
 #include <utility>
 #include <variant>
-#include <functional>
+
+#include "shared_list.h"
+#include "shared_string.h"
 
 namespace std {
     
@@ -27,6 +31,7 @@ struct MalVector;
 struct MalHashmap;
 struct MalFunction;
 struct MalAtom;
+struct MalClosure;
 
 using MalType = std::variant<
     MalNumber,
@@ -42,11 +47,6 @@ using MalType = std::variant<
     std::sptr<MalAtom>
 >;
 
-struct MalList {
-    using T = std::list<MalType>;
-    T data;
-};
-
 struct MalVector {
     using T = std::vector<MalType>;
     T data;
@@ -59,7 +59,60 @@ struct MalNumber {
 
 struct MalSymbol {
     using T = std::string;
+    using Id = std::uint32_t;
+
+    // Symbols hold only their interned id; the name lives in the intern
+    // table, so a symbol is as cheap to copy as a number.
+
+    // Where eval() finds the value. The resolver (see resolver.h) fills
+    // this in for symbols inside fn* and let* forms; anything it has not
+    // seen is looked up by id through every frame of the environment.
+    enum Binding: std::uint8_t {
+        DYNAMIC,
+        LOCAL,  // slot `slot` of the frame `depth` levels up
+        GLOBAL, // straight from the global environment
+    };
+
+    MalSymbol(std::string_view name);
+
+    const T& name() const { return name_of(id); }
+
+    Id id; // same name, same id; see MalSymbol::intern
+    Binding binding = DYNAMIC;
+    std::uint8_t depth = 0;
+    std::uint16_t slot = 0;
+
+    static Id intern(std::string_view name);
+    static const T& name_of(Id id);
+};
+
+// Ids of the symbols the evaluator dispatches on. They are interned
+// before anything else, so special forms are exactly the ids below
+// SPECIAL_FORM_COUNT.
+enum SymbolId: MalSymbol::Id {
+    SYM_DEF,
+    SYM_LET,
+    SYM_DO,
+    SYM_IF,
+    SYM_FN,
+    SYM_QUOTE,
+    SYM_QUASIQUOTE,
+    SPECIAL_FORM_COUNT,
+
+    SYM_UNQUOTE = SPECIAL_FORM_COUNT,
+    SYM_SPLICE_UNQUOTE,
+};
+
+struct MalList {
+    using T = SharedList<MalType>;
+    using Layout = std::vector<MalSymbol::Id>;
     T data;
+    // Slot names of the frame a resolved fn* or let* form creates;
+    // null for any other list.
+    std::sptr<const Layout> layout = nullptr;
+    // Body forms of a resolved fn* form, split off once so the closures
+    // it makes can share them; null for any other list.
+    std::sptr<const std::vector<MalType>> body = nullptr;
 };
 
 struct MalNil {
@@ -71,13 +124,13 @@ struct MalBool {
 };
 
 struct MalString {
-    using T = std::string;
+    using T = SharedString;
     T data;
     bool operator==(const MalString&) const = default;
 };
 
 struct MalKeyword {
-    using T = std::string;
+    using T = SharedString;
     T data;
     bool operator==(const MalKeyword&) const = default;
 };
@@ -96,8 +149,16 @@ struct MalHashmap {
     T data;
 };
 
+// A builtin, which is a plain function pointer, or a function made by
+// fn*, which eval() runs without going through any C++ call at all.
 struct MalFunction {
-    std::function<MalType(const std::vector<MalType>&)> data;
+    using Native = MalType (*)(std::span<const MalType>);
+
+    MalFunction(Native native): native(native) { }
+    MalFunction(std::sptr<MalClosure> closure): closure(std::move(closure)) { }
+
+    Native native = nullptr;       // set for builtins
+    std::sptr<MalClosure> closure; // set for functions made by fn*
 };
 
 struct MalAtom {
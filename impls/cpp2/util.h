@@ -1,9 +1,9 @@
 #ifndef _MY_UTIL_H_
 #define _MY_UTIL_H_
 
+#include <memory>
 #include <variant>
 #include <type_traits>
-#include <regex>
 
 template <typename F, typename G>
 auto echanger(F f, G e) {
@@ -23,10 +23,4 @@ inline constexpr bool is_shared_ptr_v = false;
 template <typename T>
 inline constexpr bool is_shared_ptr_v<std::shared_ptr<T>> = true;
 
-std::string regex_replace_callback(
-    const std::string& input,
-    const std::regex& re,
-    const std::function<std::string(const std::smatch&)>& callback
-);
-
 #endif // _MY_UTIL_H_